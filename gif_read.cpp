@@ -13,6 +13,9 @@
 #include "gif_read.h"
 #include <cstring> //for memcpy
 #include <stdlib.h> //for malloc, calloc, realloc, free, and exit
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #define GT_MALLOC malloc
 #define GT_REALLOC realloc
@@ -36,6 +39,18 @@ exit(-1);\
 #error "GT_PACKED not defined for this compiler"
 #endif
 
+//palette expansion has SSE2/AVX2 kernels picked at runtime on x86, and a NEON kernel wherever NEON is
+//available at compile time. Only AVX2 has a gather, so it's the only one that vectorizes the palette lookups,
+//the SSE2 and NEON kernels look colors up one at a time and only vectorize keeping transparent pixels.
+//Define GT_NO_SIMD to always use the scalar version. tests/expand_row_test.cpp checks every kernel against it
+#if !defined(GT_NO_SIMD) && (defined(__x86_64__) || defined(__i386__))
+#define GT_SIMD_X86 1
+#include <immintrin.h>
+#elif !defined(GT_NO_SIMD) && defined(__ARM_NEON)
+#define GT_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
 namespace gif_read
 {
     enum BlockType
@@ -62,14 +77,16 @@ namespace gif_read
         DM_UNDEFINED = 4
     };
     
+    //palette indices are always < 256, so a byte per index is enough
     struct IndexStream
     {
-        uint16* indices = nullptr;
+        uint8* indices = nullptr;
         uint32 numIndices = 0;
+        uint32 maxIndices = 0;
     };
     
-    const uint32 MAX_GIF_FRAMES = 4096;
     const uint32 MAX_CODETABLE_ROWS = 4096;
+    const uint16 MAX_LZW_MIN_CODE_SIZE = 11; //any bigger and the clear and eof codes don't fit in the code table
     const uint32 NO_INDEX = 9999;
     const uint32 NO_BYTE = 9999;
     const uint16 NO_CODE = 9999;
@@ -118,10 +135,14 @@ namespace gif_read
     };
     static_assert(sizeof(ImageDescriptor) == 9, "ImageDescriptor is an incorrect size, needs to be packed");
     
+    //length and firstByte are cached when a row is added, so that emitting a code doesn't
+    //need to walk the prev chain to find out how long it is or what it starts with
     struct CodeTableRow
     {
-        uint16 byte = NO_BYTE;
-        uint16 prev = NO_CODE;
+        uint16 byte;
+        uint16 prev;
+        uint16 length;
+        uint16 firstByte;
     };
     
     struct LZWCodeTable
@@ -131,10 +152,35 @@ namespace gif_read
         CodeTableRow rows[MAX_CODETABLE_ROWS];
     };
     
+    struct CopyTableRow
+    {
+        uint32 offset; //into the index stream currently being decoded
+        uint16 length;
+        uint16 byte; //only used by roots
+    };
+    
+    struct LZWCopyTable
+    {
+        uint16 codeSize;
+        uint16 numCodes;
+        CopyTableRow rows[MAX_CODETABLE_ROWS];
+    };
+    
+    //storage for the table used by whichever decoder a gif was loaded with
+    struct LZWTables
+    {
+        LZWDecoder decoder;
+        union
+        {
+            LZWCodeTable codeTable;
+            LZWCopyTable copyTable;
+        };
+    };
+    
     struct Frame
     {
         ImageDescriptor imageDesc;
-        Color* localColorTable; //if null, use global color table
+        uint32* localPalette; //if null, use global palette
         uint16 lzwMinCodeSize;
     };
     
@@ -146,116 +192,441 @@ namespace gif_read
         uint8 transparentFlag:1;
     };
     
+    //codes are read out of a 64 bit buffer that gets refilled a word at a time. Any bits left over
+    //at the end of a sub block (ie - a code that spans 2 sub blocks) are carried over to the next call
     struct DecompressionState
     {
-        uint16 partialCode = NO_CODE;
+        uint64 bitBuffer = 0;
+        uint32 bitsInBuffer = 0;
         uint16 prevCode = NO_CODE;
-        uint16 mask = 0x01;
-        uint16 bitsCurrentlyRead = 0;
+        bool finished = false; //hit the end of information code, or data that can't be decoded
+    };
+    
+    //where a frame's decoded indices end up. Decoders hand each row over to compositeRow as soon as it's
+    //complete, so the pixels get written while its indices are still in cache, instead of in a second
+    //pass over the whole frame
+    struct FrameTarget
+    {
+        uint8* canvas;
+        uint32 canvasWidth;
+        uint32 canvasHeight;
+        const uint32* palette;
+        uint32 transparentIdx;
+        const ImageDescriptor* imageDesc;
+        uint32 cropX = 0; //gif pixel that ends up at the top left of the canvas
+        uint32 cropY = 0;
+        uint32 scaleShift = 0; //canvas is 1/(1 << scaleShift) of the cropped size
+        uint32 bytesPerPixel = 4;
+        const uint8* remap = nullptr; //if set, the canvas holds a palette index per pixel, mapped through remap
+        uint32 nextRow = 0; //row of the frame (not the canvas) that will be written next
+        uint32 rowStart = 0; //where nextRow starts in the index stream
     };
     
     //data common to all gifImpls
     struct GifFileData
     {
         Header header = {0};
-        Color* globalColorTable = nullptr;
+        uint32* globalPalette = nullptr; //always allocated, even if the file has no global color table
         uint32 numFrames = 0;
         uint32 numGfxBlocks = 0;
-        GraphicsControlBlock gfxControlBlocks[MAX_GIF_FRAMES];
+        LZWDecoder decoder = LD_CodeTable;
+        GraphicsControlBlock* gfxControlBlocks = nullptr; //sized by countBlocks before parsing
         uint32 totalRunTime;
-        Frame imageData[MAX_GIF_FRAMES];
+        Frame* imageData = nullptr; //sized by countBlocks before parsing
+        
+        //frames being output, which are the size of the gif unless they're being cropped or downscaled
+        uint32 cropX = 0;
+        uint32 cropY = 0;
+        uint32 scaleShift = 0;
+        uint32 canvasWidth = 0;
+        uint32 canvasHeight = 0;
+        PixelFormat pixelFormat = PF_RGBA8888; //of every palette
+        bool transparentBackground = false; //clear to transparent black instead of the background color
+        uint32 bytesPerPixel = 4; //of the canvas and every frame stored from it
     };
     
-#pragma mark - GIF parsing functions
-    void InitializeCodeTable(LZWCodeTable& table, uint16 colorTableLen, uint16 lzwMinCodeSize)
+#pragma mark - palette expansion
+    //every kernel writes palette[indices[i]] to out[i], except where indices[i] == transparentIdx, which
+    //keeps the previous value of out[i]. transparentIdx > 0xFF means there's no transparency
+    typedef void (*ExpandRowFunc)(uint32* out, const uint8* indices, uint32 count, const uint32* palette, uint32 transparentIdx);
+    
+    //reference implementation, and what the SIMD kernels use for whatever is left at the end of a row
+    void expandRowScalar(uint32* out, const uint8* indices, uint32 count, const uint32* palette, uint32 transparentIdx)
     {
-        uint16 numColors = 1 << (colorTableLen + 1);
+        if (transparentIdx > 0xFF || !memchr(indices, (uint8)transparentIdx, count))
+        {
+            for (uint32 i = 0; i < count; ++i) out[i] = palette[indices[i]];
+            return;
+        }
+        
+        for (uint32 i = 0; i < count; ++i)
+        {
+            if (indices[i] != transparentIdx) out[i] = palette[indices[i]];
+        }
+    }
+    
+#if GT_SIMD_X86
+    //not really a SIMD lookup: with no gather in SSE2, the palette lookups are 4 scalar loads, and only keeping
+    //transparent pixels is vectorized (as a branchless select). Rows with no transparency go straight to scalar
+    void expandRowSSE2(uint32* out, const uint8* indices, uint32 count, const uint32* palette, uint32 transparentIdx)
+    {
+        uint32 i = 0;
+        if (transparentIdx <= 0xFF)
+        {
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i transparent = _mm_set1_epi32(transparentIdx);
+            for (; i + 4 <= count; i += 4)
+            {
+                int32 packedIndices;
+                memcpy(&packedIndices, indices + i, sizeof(int32));
+                __m128i idx = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packedIndices), zero), zero);
+                __m128i mask = _mm_cmpeq_epi32(idx, transparent);
+                
+                __m128i color = _mm_set_epi32(palette[indices[i+3]], palette[indices[i+2]], palette[indices[i+1]], palette[indices[i]]);
+                __m128i prev = _mm_loadu_si128((const __m128i*)(out + i));
+                _mm_storeu_si128((__m128i*)(out + i), _mm_or_si128(_mm_and_si128(mask, prev), _mm_andnot_si128(mask, color)));
+            }
+        }
+        
+        expandRowScalar(out + i, indices + i, count - i, palette, transparentIdx);
+    }
+    
+    __attribute__((target("avx2")))
+    void expandRowAVX2(uint32* out, const uint8* indices, uint32 count, const uint32* palette, uint32 transparentIdx)
+    {
+        uint32 i = 0;
+        if (transparentIdx > 0xFF)
+        {
+            for (; i + 8 <= count; i += 8)
+            {
+                __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(indices + i)));
+                _mm256_storeu_si256((__m256i*)(out + i), _mm256_i32gather_epi32((const int*)palette, idx, 4));
+            }
+        }
+        else
+        {
+            const __m256i transparent = _mm256_set1_epi32(transparentIdx);
+            for (; i + 8 <= count; i += 8)
+            {
+                __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(indices + i)));
+                __m256i color = _mm256_i32gather_epi32((const int*)palette, idx, 4);
+                __m256i prev = _mm256_loadu_si256((const __m256i*)(out + i));
+                __m256i mask = _mm256_cmpeq_epi32(idx, transparent);
+                _mm256_storeu_si256((__m256i*)(out + i), _mm256_blendv_epi8(color, prev, mask));
+            }
+        }
+        
+        expandRowScalar(out + i, indices + i, count - i, palette, transparentIdx);
+    }
+#endif
+    
+#if GT_SIMD_NEON
+    //like the SSE2 kernel, the lookups are scalar and only the transparent select is vectorized
+    void expandRowNEON(uint32* out, const uint8* indices, uint32 count, const uint32* palette, uint32 transparentIdx)
+    {
+        uint32 i = 0;
+        if (transparentIdx <= 0xFF)
+        {
+            const uint32x4_t transparent = vdupq_n_u32(transparentIdx);
+            for (; i + 4 <= count; i += 4)
+            {
+                uint32 lookups[4] = { palette[indices[i]], palette[indices[i+1]], palette[indices[i+2]], palette[indices[i+3]] };
+                uint32 idxs[4] = { indices[i], indices[i+1], indices[i+2], indices[i+3] };
+                uint32x4_t mask = vceqq_u32(vld1q_u32(idxs), transparent);
+                vst1q_u32(out + i, vbslq_u32(mask, vld1q_u32(out + i), vld1q_u32(lookups)));
+            }
+        }
         
+        expandRowScalar(out + i, indices + i, count - i, palette, transparentIdx);
+    }
+#endif
+    
+    ExpandRowFunc selectExpandRow()
+    {
+#if GT_SIMD_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) return expandRowAVX2;
+        if (__builtin_cpu_supports("sse2")) return expandRowSSE2;
+#elif GT_SIMD_NEON
+        return expandRowNEON;
+#endif
+        return expandRowScalar;
+    }
+    
+    //picked the first time it's needed, which the standard guarantees is thread safe
+    void expandRow(uint32* out, const uint8* indices, uint32 count, const uint32* palette, uint32 transparentIdx)
+    {
+        static const ExpandRowFunc kernel = selectExpandRow();
+        kernel(out, indices, count, palette, transparentIdx);
+    }
+    
+    //formats smaller than 4 bytes are stored at the start of each palette entry, and only that much of the entry
+    //gets copied. These aren't vectorized like the 4 byte kernels
+    template<uint32 BytesPerPixel>
+    void expandRowBytes(uint8* out, const uint8* indices, uint32 count, const uint32* palette, uint32 transparentIdx)
+    {
+        for (uint32 i = 0; i < count; ++i)
+        {
+            if (indices[i] != transparentIdx) memcpy(out + i * BytesPerPixel, &palette[indices[i]], BytesPerPixel);
+        }
+    }
+    
+    void expandRowToFormat(uint8* out, const uint8* indices, uint32 count, const uint32* palette, uint32 transparentIdx, uint32 bytesPerPixel)
+    {
+        switch(bytesPerPixel)
+        {
+            case 4: expandRow((uint32*)out, indices, count, palette, transparentIdx); break;
+            case 3: expandRowBytes<3>(out, indices, count, palette, transparentIdx); break;
+            case 2: expandRowBytes<2>(out, indices, count, palette, transparentIdx); break;
+            default: expandRowBytes<1>(out, indices, count, palette, transparentIdx); break;
+        }
+    }
+    
+    //same as expandRow, for canvases that store palette indices instead of colors
+    void remapRow(uint8* out, const uint8* indices, uint32 count, const uint8* remap, uint32 transparentIdx)
+    {
+        for (uint32 i = 0; i < count; ++i)
+        {
+            if (indices[i] != transparentIdx) out[i] = remap[indices[i]];
+        }
+    }
+    
+#pragma mark - GIF parsing functions
+    //clear codes only need to forget the rows that were added since the last clear. Roots are never
+    //overwritten, so they only need to be set up once per frame by InitializeCodeTable
+    void ResetCodeTable(LZWCodeTable& table, uint16 lzwMinCodeSize)
+    {
         table.codeSize = lzwMinCodeSize;
         table.numCodes = (1 << table.codeSize) + 2;
+    }
+    
+    void InitializeCodeTable(LZWCodeTable& table, uint16 colorTableLen, uint16 lzwMinCodeSize)
+    {
+        uint16 numColors = 1 << (colorTableLen + 1);
+        ResetCodeTable(table, lzwMinCodeSize);
         
-        for (uint32 i = 0; i < MAX_CODETABLE_ROWS; ++i)
+        for (uint32 i = 0; i < table.numCodes; ++i)
         {
             CodeTableRow& row = table.rows[i];
             row.byte = i < numColors ? i : NO_BYTE;
             row.prev = NO_INDEX;
+            row.length = 1;
+            row.firstByte = row.byte;
         }
     }
     
-    //returns stored part of code in case a single code spans between multiple sub blocks
-    DecompressionState compressedDataToIndexStream(const uint8* compressedData, uint16 sizeOfCompressedData, uint8 colorTableSize, uint16 lzwMinCodeSize, LZWCodeTable& codeTable, DecompressionState& prevState, IndexStream& outputStream)
+    void ResetCodeTable(LZWCopyTable& table, uint16 lzwMinCodeSize)
     {
-        DecompressionState state;
-        state.prevCode = prevState.prevCode != NO_CODE ? prevState.prevCode : NO_CODE;
-        state.mask = prevState.partialCode != NO_CODE ? prevState.mask : 0x01;
-        
-        uint16& mask = state.mask; //faster to get a reference to this once than to keep accessing state.mask
-        uint16 clearCode = 1 << lzwMinCodeSize;
-        uint16 eofCode = clearCode+1;
-        
-        const uint8* blockData = compressedData;
-        uint32 bytesRead = 0;
+        table.codeSize = lzwMinCodeSize;
+        table.numCodes = (1 << table.codeSize) + 2;
+    }
+    
+    //the copy-from-output decoder doesn't store strings at all. Every string a code refers to
+    //has already been written to the index stream, so rows only need to remember where. Roots
+    //(length 1) store their color index in byte instead
+    void InitializeCopyTable(LZWCopyTable& table, uint16 colorTableLen, uint16 lzwMinCodeSize)
+    {
+        uint16 numColors = 1 << (colorTableLen + 1);
+        ResetCodeTable(table, lzwMinCodeSize);
         
-        while(bytesRead < sizeOfCompressedData)
+        for (uint32 i = 0; i < table.numCodes; ++i)
         {
-            uint16 curCode = prevState.partialCode != NO_CODE ? prevState.partialCode : 0;
-            uint16 startingBit = prevState.partialCode != NO_CODE ? prevState.bitsCurrentlyRead : 0;
-            prevState.partialCode = NO_CODE;
-            
-            for (uint16 i = startingBit; i < codeTable.codeSize+1; ++i)
+            CopyTableRow& row = table.rows[i];
+            row.offset = 0;
+            row.length = 1;
+            row.byte = i < numColors ? i : NO_BYTE;
+        }
+    }
+    
+    //pulls the next code out of the bit buffer, refilling it from data as needed. Returns false if
+    //data runs out partway through a code, in which case the bits that were read stay in the buffer
+    inline bool readCode(uint64& bitBuffer, uint32& bitsInBuffer, const uint8*& data, const uint8* dataEnd, uint32 codeBits, uint16& outCode)
+    {
+        if (bitsInBuffer < codeBits)
+        {
+            if (dataEnd - data >= 8)
             {
-                uint16 bit = ((*blockData) & mask) ? 1 : 0;
-                mask = mask << 1;
-                
-                if (mask == 0x100)
+                //bits above bitsInBuffer are either 0 or the same bits we're about to OR in, so this doesn't
+                //need to mask anything. Assumes a little endian platform, same as the header parsing code
+                uint64 word;
+                memcpy(&word, data, sizeof(uint64));
+                bitBuffer |= word << bitsInBuffer;
+                data += (63 - bitsInBuffer) >> 3;
+                bitsInBuffer |= 56;
+            }
+            else
+            {
+                while (bitsInBuffer <= 56 && data < dataEnd)
                 {
-                    mask = 0x01;
-                    bytesRead++;
-                    blockData++;
+                    bitBuffer |= (uint64)(*data++) << bitsInBuffer;
+                    bitsInBuffer += 8;
                 }
                 
-                curCode = curCode | (bit << i);
-                if (bytesRead == sizeOfCompressedData)
+                if (bitsInBuffer < codeBits)
                 {
-                    state.partialCode = curCode;
-                    state.bitsCurrentlyRead = i+1;
-                    return state;
+                    bitBuffer &= (1ull << bitsInBuffer) - 1;
+                    return false;
                 }
             }
+        }
+        
+        outCode = (uint16)(bitBuffer & ((1 << codeBits) - 1));
+        bitBuffer >>= codeBits;
+        bitsInBuffer -= codeBits;
+        return true;
+    }
+    
+    void writeRow(FrameTarget& target, uint32 pixelOffset, const uint8* indices, uint32 count)
+    {
+        if (target.remap)
+        {
+            remapRow(target.canvas + pixelOffset, indices, count, target.remap, target.transparentIdx);
+        }
+        else
+        {
+            expandRowToFormat(target.canvas + pixelOffset * target.bytesPerPixel, indices, count, target.palette, target.transparentIdx, target.bytesPerPixel);
+        }
+    }
+    
+    //writes count indices to the next row of the frame, clipped to the canvas. Transparent pixels keep
+    //whatever was already in the canvas
+    void compositeRow(FrameTarget& target, const uint8* indices, uint32 count)
+    {
+        uint32 x = target.imageDesc->xPos;
+        uint32 y = target.imageDesc->yPos + target.nextRow;
+        if (target.nextRow++ >= target.imageDesc->height) return;
+        
+        //move into crop space, dropping anything above or left of the crop before it gets near a palette
+        if (y < target.cropY) return;
+        y -= target.cropY;
+        if (x < target.cropX)
+        {
+            uint32 skip = target.cropX - x;
+            if (count <= skip) return;
+            indices += skip;
+            count -= skip;
+            x = 0;
+        }
+        else
+        {
+            x -= target.cropX;
+        }
+        
+        //downscaled canvases only keep the pixels whose gif coordinates are both multiples of the scale
+        if (target.scaleShift > 0)
+        {
+            uint32 mask = (1 << target.scaleShift) - 1;
+            if (y & mask) return;
             
+            uint32 skip = (mask + 1 - (x & mask)) & mask;
+            if (count <= skip) return;
+            indices += skip;
+            count = ((count - skip) + mask) >> target.scaleShift;
+            x = (x + skip) >> target.scaleShift;
+            y >>= target.scaleShift;
+            
+            if (x >= target.canvasWidth || y >= target.canvasHeight) return;
+            if (count > target.canvasWidth - x) count = target.canvasWidth - x;
+            
+            //gathered a chunk at a time, so the kept pixels still go through the vectorized expandRow
+            uint32 pixelOffset = y * target.canvasWidth + x;
+            uint8 gathered[256];
+            while (count > 0)
+            {
+                uint32 chunk = count < sizeof(gathered) ? count : sizeof(gathered);
+                for (uint32 i = 0; i < chunk; ++i)
+                {
+                    gathered[i] = indices[i << target.scaleShift];
+                }
+                writeRow(target, pixelOffset, gathered, chunk);
+                
+                indices += chunk << target.scaleShift;
+                pixelOffset += chunk;
+                count -= chunk;
+            }
+            return;
+        }
+        
+        if (x >= target.canvasWidth || y >= target.canvasHeight) return;
+        if (count > target.canvasWidth - x) count = target.canvasWidth - x;
+        
+        writeRow(target, y * target.canvasWidth + x, indices, count);
+    }
+    
+    void compositeCompletedRows(IndexStream& stream, FrameTarget& target)
+    {
+        uint32 frameWidth = target.imageDesc->width;
+        if (frameWidth == 0) return;
+        
+        while (stream.numIndices - target.rowStart >= frameWidth)
+        {
+            compositeRow(target, stream.indices + target.rowStart, frameWidth);
+            target.rowStart += frameWidth;
+        }
+    }
+    
+    //writes whatever is left of a frame that ended partway through a row
+    void compositePartialRow(IndexStream& stream, FrameTarget& target)
+    {
+        if (stream.numIndices > target.rowStart)
+        {
+            compositeRow(target, stream.indices + target.rowStart, stream.numIndices - target.rowStart);
+            target.rowStart = stream.numIndices;
+        }
+    }
+    
+    //returns stored part of code in case a single code spans between multiple sub blocks. Indices are only
+    //kept in outputStream until their row has been composited, so it only needs to be big enough to hold
+    //one row plus the longest possible string. With no target, nothing is composited and outputStream
+    //needs to hold the whole frame
+    DecompressionState compressedDataToIndexStream(const uint8* compressedData, uint32 sizeOfCompressedData, uint16 lzwMinCodeSize, LZWCodeTable& codeTable, DecompressionState& prevState, IndexStream& outputStream, FrameTarget* target)
+    {
+        DecompressionState state;
+        state.prevCode = prevState.prevCode;
+        
+        //leftover bits are consumed here, so clear them out of prevState in case the caller reuses it
+        uint64 bitBuffer = prevState.bitBuffer;
+        uint32 bitsInBuffer = prevState.bitsInBuffer;
+        prevState.bitBuffer = 0;
+        prevState.bitsInBuffer = 0;
+        
+        uint16 clearCode = 1 << lzwMinCodeSize;
+        uint16 eofCode = clearCode+1;
+        
+        const uint8* blockData = compressedData;
+        const uint8* blockEnd = compressedData + sizeOfCompressedData;
+        
+        uint16 curCode;
+        while(readCode(bitBuffer, bitsInBuffer, blockData, blockEnd, codeTable.codeSize+1, curCode))
+        {
             if (curCode == clearCode)
             {
-                InitializeCodeTable(codeTable, colorTableSize, lzwMinCodeSize);
+                ResetCodeTable(codeTable, lzwMinCodeSize);
                 state.prevCode = NO_CODE;
                 continue;
             }
             else if (curCode == eofCode)
             {
-                break;
+                state.finished = true;
+                return state;
             }
-            else if (state.prevCode != NO_CODE && codeTable.codeSize < 12)
+            else if (curCode > codeTable.numCodes || (curCode == codeTable.numCodes && state.prevCode == NO_CODE))
             {
-                GT_CHECK(curCode <= codeTable.numCodes, "Error parsing compressed data for an image data sub block. Got code %i, but the code table is size %i, which means the next new code should have been %i.", curCode, codeTable.numCodes, codeTable.numCodes);
-                
-                uint16 codePtr = NO_CODE;
-                
-                if (curCode == codeTable.numCodes)
-                {
-                    codePtr = state.prevCode;
-                }
-                else
-                {
-                    codePtr = curCode;
-                }
-                
-                while ( codeTable.rows[codePtr].prev != NO_INDEX )
-                {
-                    codePtr = codeTable.rows[codePtr].prev;
-                }
+                //rows past numCodes may be left over from before the last clear code, or never set at all,
+                //so stop decoding this frame instead of emitting garbage
+                GT_CHECK(false, "Error parsing compressed data for an image data sub block. Got code %i, but the code table is size %i", curCode, codeTable.numCodes);
+                state.finished = true;
+                return state;
+            }
+            else if (state.prevCode != NO_CODE && codeTable.numCodes < MAX_CODETABLE_ROWS)
+            {
+                const CodeTableRow& prevRow = codeTable.rows[state.prevCode];
                 
                 CodeTableRow& newRow = codeTable.rows[codeTable.numCodes];
-                newRow.byte = codeTable.rows[codePtr].byte;
+                newRow.byte = curCode == codeTable.numCodes ? prevRow.firstByte : codeTable.rows[curCode].firstByte;
                 newRow.prev = state.prevCode;
+                newRow.length = prevRow.length + 1;
+                newRow.firstByte = prevRow.firstByte;
                 codeTable.numCodes++;
                 
                 //increase code size if we've filled so many slots in the table that the next index
@@ -268,112 +639,382 @@ namespace gif_read
             
             state.prevCode = curCode;
             
-            uint16 codes[1024];
-            uint32 numCodes = 0;
+            if (outputStream.numIndices + codeTable.rows[curCode].length > outputStream.maxIndices)
+            {
+                GT_CHECK(false, "Error parsing compressed gif data. Frame contains more indices than its size allows");
+                state.finished = true;
+                return state;
+            }
+            
+            //we know how long the string is, so write it straight into the output back to front
+            uint8* out = outputStream.indices + outputStream.numIndices + codeTable.rows[curCode].length;
+            outputStream.numIndices += codeTable.rows[curCode].length;
             while (curCode != NO_CODE)
             {
-                GT_CHECK(numCodes < 1024, "Error parsing compressed gif data. A code refers to more than 1024 color values but our buffer's size is 1024");
-                
-                CodeTableRow& curRow = codeTable.rows[curCode];
+                const CodeTableRow& curRow = codeTable.rows[curCode];
                 GT_CHECK(curRow.prev != curCode, "Error parsing compressed gif data. A codetable row's prevCode value points to itself");
                 
-                codes[numCodes++] = curRow.byte;
+                *--out = (uint8)curRow.byte;
                 curCode = curRow.prev;
             }
             
-            if (numCodes > 0)
+            if (target && outputStream.numIndices - target->rowStart >= target->imageDesc->width)
             {
-                for (int32 b = numCodes-1; b > -1; b--)
-                {
-                    outputStream.indices[outputStream.numIndices++] = codes[b];
-                }
+                compositeCompletedRows(outputStream, *target);
+                
+                //nothing refers back to indices once they've been composited, so move what's left of
+                //the current row to the front of the stream
+                outputStream.numIndices -= target->rowStart;
+                memmove(outputStream.indices, outputStream.indices + target->rowStart, outputStream.numIndices);
+                target->rowStart = 0;
             }
         }
         
+        state.bitBuffer = bitBuffer;
+        state.bitsInBuffer = bitsInBuffer;
         return state;
     }
     
-    void indexStreamToColorArray(const IndexStream& indexStream, const Color* colorTable, uint8* outputArray, uint32 transparentColorIdx, const Frame& frame, const Header& header)
+    //same as compressedDataToIndexStream, but emits each code by copying its string from where it was
+    //previously written in outputStream, instead of walking a linked list of table rows. Since codes can
+    //refer to anything written so far, outputStream needs to be big enough to hold the whole frame
+    DecompressionState compressedDataToIndexStreamByCopy(const uint8* compressedData, uint32 sizeOfCompressedData, uint16 lzwMinCodeSize, LZWCopyTable& codeTable, DecompressionState& prevState, IndexStream& outputStream, FrameTarget* target)
     {
-        uint32 w = header.width;
-        uint32 bytesWritten = 0;
-        uint32 nextIdx = 0;
+        DecompressionState state;
+        state.prevCode = prevState.prevCode;
+        
+        uint64 bitBuffer = prevState.bitBuffer;
+        uint32 bitsInBuffer = prevState.bitsInBuffer;
+        prevState.bitBuffer = 0;
+        prevState.bitsInBuffer = 0;
+        
+        uint16 clearCode = 1 << lzwMinCodeSize;
+        uint16 eofCode = clearCode+1;
         
-        //frame rect
-        uint32 frameMinX = frame.imageDesc.xPos;
-        uint32 frameMinY = frame.imageDesc.yPos;
-        uint32 frameMaxX = frameMinX + frame.imageDesc.width;
-        uint32 frameMaxY = frameMinY + frame.imageDesc.height;
+        const uint8* blockData = compressedData;
+        const uint8* blockEnd = compressedData + sizeOfCompressedData;
         
-        uint32 startPixel = frameMinY*w + frameMinX;
-        uint32 endPixel = frameMaxY*w + frameMaxX;
-        for (int i = startPixel; i < endPixel; ++i)
+        uint16 curCode;
+        while(readCode(bitBuffer, bitsInBuffer, blockData, blockEnd, codeTable.codeSize+1, curCode))
         {
-            uint32 thisY = i / w;
-            uint32 thisX = i-(thisY * w);
+            if (curCode == clearCode)
+            {
+                ResetCodeTable(codeTable, lzwMinCodeSize);
+                state.prevCode = NO_CODE;
+                continue;
+            }
+            else if (curCode == eofCode)
+            {
+                state.finished = true;
+                return state;
+            }
+            else if (curCode > codeTable.numCodes || (curCode == codeTable.numCodes && state.prevCode == NO_CODE))
+            {
+                //rows past numCodes may be left over from before the last clear code, or never set at all,
+                //so stop decoding this frame instead of emitting garbage
+                GT_CHECK(false, "Error parsing compressed data for an image data sub block. Got code %i, but the code table is size %i", curCode, codeTable.numCodes);
+                state.finished = true;
+                return state;
+            }
+            else if (state.prevCode != NO_CODE && codeTable.numCodes < MAX_CODETABLE_ROWS)
+            {
+                //the new string is the previous one plus the first index of this one, and since this
+                //one is about to be written right after the previous one, that's already in the stream
+                uint16 prevLength = codeTable.rows[state.prevCode].length;
+                CopyTableRow& newRow = codeTable.rows[codeTable.numCodes];
+                newRow.offset = outputStream.numIndices - prevLength;
+                newRow.length = prevLength + 1;
+                codeTable.numCodes++;
+                
+                if (codeTable.numCodes == (1 << (codeTable.codeSize+1)) && codeTable.codeSize < 11)
+                {
+                    codeTable.codeSize++;
+                }
+            }
+            
+            state.prevCode = curCode;
             
-            bool isInFrame = thisX >= frameMinX && thisX < frameMaxX &&
-            thisY >= frameMinY && thisY < frameMaxY;
+            const CopyTableRow& row = codeTable.rows[curCode];
+            if (outputStream.numIndices + row.length > outputStream.maxIndices)
+            {
+                GT_CHECK(false, "Error parsing compressed gif data. Frame contains more indices than its size allows");
+                state.finished = true;
+                return state;
+            }
             
-            if (isInFrame)
+            uint8* out = outputStream.indices + outputStream.numIndices;
+            if (row.length == 1)
+            {
+                *out = (uint8)row.byte;
+            }
+            else
             {
-                uint32 code = indexStream.indices[nextIdx++];
-                if (code != transparentColorIdx)
+                //if curCode is the row that was just added, its string overlaps the place we're writing it
+                //to, and needs to be copied front to back one index at a time to repeat the first index
+                const uint8* src = outputStream.indices + row.offset;
+                if (src + row.length <= out)
                 {
-                    const uint8* col = colorTable[code].rgb;
-                    outputArray[i*4] = col[0];
-                    outputArray[i*4+1] = col[1];
-                    outputArray[i*4+2] = col[2];
-                    outputArray[i*4+3] = 255;
+                    memcpy(out, src, row.length);
                 }
-                bytesWritten++;
+                else
+                {
+                    for (uint32 i = 0; i < row.length; ++i) out[i] = src[i];
+                }
+            }
+            outputStream.numIndices += row.length;
+            
+            if (target && outputStream.numIndices - target->rowStart >= target->imageDesc->width)
+            {
+                compositeCompletedRows(outputStream, *target);
             }
         }
         
-        //  GT_CHECK(bytesWritten == indexStream.numIndices, "Didn't write all bytes to color array");
+        state.bitBuffer = bitBuffer;
+        state.bitsInBuffer = bitsInBuffer;
+        return state;
     }
     
-    const uint8* parseHeader(const uint8* dataPtr, Header& header)
+    void InitializeTables(LZWTables& tables, uint16 colorTableLen, uint16 lzwMinCodeSize)
     {
-        memcpy(&header, dataPtr, sizeof(Header));
-        dataPtr += sizeof(Header);
-        return dataPtr;
+        if (tables.decoder == LD_CopyFromOutput)
+        {
+            InitializeCopyTable(tables.copyTable, colorTableLen, lzwMinCodeSize);
+        }
+        else
+        {
+            InitializeCodeTable(tables.codeTable, colorTableLen, lzwMinCodeSize);
+        }
     }
     
-    const uint8* parseGlobalColorTable(const uint8* dataPtr, Color** colorTable, const Header& header)
+    uint32 indexStreamSizeForFrame(const Frame& frame, LZWDecoder decoder)
     {
-        if (header.screenDescriptor.hasGlobalColorTable)
+        if (decoder == LD_CopyFromOutput) return frame.imageDesc.width * frame.imageDesc.height;
+        return frame.imageDesc.width + MAX_CODETABLE_ROWS;
+    }
+    
+    void reserveIndexStream(IndexStream& stream, uint32 size)
+    {
+        if (stream.maxIndices < size)
         {
-            uint16 numEntries = 1 << (header.screenDescriptor.colorTableSize + 1);
-            *colorTable = (Color*)GT_MALLOC(sizeof(Color) * numEntries);
-            memcpy(*colorTable, dataPtr, sizeof(Color) * numEntries);
-            dataPtr += sizeof(Color) * numEntries;
+            stream.indices = (uint8*)GT_REALLOC(stream.indices, size);
+            stream.maxIndices = size;
         }
+    }
+    
+    //decompresses compressedData straight into target's canvas, using whichever decoder tables was set up for.
+    //If target is null, the indices are left in outputStream to be composited later
+    DecompressionState decompressToFrame(const uint8* compressedData, uint32 sizeOfCompressedData, uint16 lzwMinCodeSize, LZWTables& tables, DecompressionState& prevState, IndexStream& outputStream, FrameTarget* target)
+    {
+        //a frame with no width would never complete a row, and has nothing to draw anyway
+        if (prevState.finished || (target && target->imageDesc->width == 0)) return prevState;
         
-        return dataPtr;
+        if (tables.decoder == LD_CopyFromOutput)
+        {
+            return compressedDataToIndexStreamByCopy(compressedData, sizeOfCompressedData, lzwMinCodeSize, tables.copyTable, prevState, outputStream, target);
+        }
+        return compressedDataToIndexStream(compressedData, sizeOfCompressedData, lzwMinCodeSize, tables.codeTable, prevState, outputStream, target);
     }
     
-    const uint8* parseExtension(const uint8* dataPtr, uint32& totalRunTime, GraphicsControlBlock* gfxControlBlocks, uint32& numGfxBlocks)
+    //decompresses a frame straight out of the sub blocks it's stored in. Runs of sub blocks are copied into a
+    //small buffer first, so the decoder only has to stop and carry a code over to the next call once per run
+    //instead of once per (at most 255 byte) sub block. Returns a pointer to the block terminator after the
+    //last sub block
+    const uint8* decompressSubBlocks(const uint8* subBlocks, uint16 lzwMinCodeSize, LZWTables& tables, DecompressionState dcState, IndexStream& outputStream, FrameTarget* target)
     {
-        uint8 extensionType = *dataPtr++;
-        uint8 blockSizeBytes = *dataPtr++;
+        uint8 run[4096];
+        uint32 runSize = 0;
         
-        switch(extensionType)
+        uint8 sizeOfSubBlock = *subBlocks;
+        if (sizeOfSubBlock > 0) subBlocks++;
+        while(sizeOfSubBlock > 0)
         {
-            case ET_GraphicsControl:
+            if (runSize + sizeOfSubBlock > sizeof(run))
             {
-                GraphicsControlBlock block;
-                uint8 packedData = *dataPtr++;
-                block.transparentFlag = (0x1 & packedData);
-                block.disposal = (DisposalMethod)(packedData >> 2);
-                GT_CHECK(block.disposal != DM_RESTORE_TO_PREVIOUS_FRAME, "Restore clear mode is unsupported.");
-                GT_CHECK(block.disposal < DM_UNDEFINED, "Unknown or unhandled block disposal method in GraphicsControlBlock");
-                
-                block.delayTime = *dataPtr;
-                totalRunTime+=block.delayTime;
-                dataPtr+=2;
+                dcState = decompressToFrame(run, runSize, lzwMinCodeSize, tables, dcState, outputStream, target);
+                runSize = 0;
+            }
+            memcpy(run + runSize, subBlocks, sizeOfSubBlock);
+            runSize += sizeOfSubBlock;
+            
+            subBlocks += sizeOfSubBlock;
+            sizeOfSubBlock = *subBlocks;
+            if (sizeOfSubBlock > 0) subBlocks++;
+        }
+        
+        if (runSize > 0)
+        {
+            decompressToFrame(run, runSize, lzwMinCodeSize, tables, dcState, outputStream, target);
+        }
+        return subBlocks;
+    }
+    
+    uint32 transparentIdxForFrame(const GifFileData& gif, uint32 frameIdx)
+    {
+        if (frameIdx < gif.numGfxBlocks && gif.gfxControlBlocks[frameIdx].transparentFlag)
+        {
+            return gif.gfxControlBlocks[frameIdx].transparentColorIdx;
+        }
+        return NO_CODE;
+    }
+    
+    void setupFrameTarget(FrameTarget& target, uint8* canvas, const GifFileData& gif, const Frame& frame, uint32 frameIdx)
+    {
+        target.canvas = canvas;
+        target.canvasWidth = gif.canvasWidth;
+        target.canvasHeight = gif.canvasHeight;
+        target.cropX = gif.cropX;
+        target.cropY = gif.cropY;
+        target.scaleShift = gif.scaleShift;
+        target.bytesPerPixel = gif.bytesPerPixel;
+        target.remap = nullptr;
+        
+        target.palette = frame.localPalette ? frame.localPalette : gif.globalPalette;
+        target.transparentIdx = transparentIdxForFrame(gif, frameIdx);
+        target.imageDesc = &frame.imageDesc;
+        target.nextRow = 0;
+        target.rowStart = 0;
+    }
+    
+    const uint8* parseHeader(const uint8* dataPtr, Header& header)
+    {
+        memcpy(&header, dataPtr, sizeof(Header));
+        dataPtr += sizeof(Header);
+        return dataPtr;
+    }
+    
+    uint32 scaleShiftForDownscale(uint32 downscale)
+    {
+        if (downscale >= 8) return 3;
+        if (downscale >= 4) return 2;
+        if (downscale >= 2) return 1;
+        return 0;
+    }
+    
+    uint32 bytesPerPixelForFormat(PixelFormat format)
+    {
+        switch(format)
+        {
+            case PF_RGB888: return 3;
+            case PF_RGB565: return 2;
+            case PF_A8: return 1;
+            default: return 4;
+        }
+    }
+    
+    //sizes the canvas from the header, after clipping the crop rect to the gif. Downscaling rounds up, so that
+    //the last pixel kept in each row and column still has somewhere to go
+    void setupCanvas(GifFileData& gif, const DecodeOptions& options)
+    {
+        uint32 width = gif.header.width;
+        uint32 height = gif.header.height;
+        gif.cropX = 0;
+        gif.cropY = 0;
+        
+        if (options.cropWidth > 0 && options.cropHeight > 0)
+        {
+            gif.cropX = options.cropX < width ? options.cropX : width;
+            gif.cropY = options.cropY < height ? options.cropY : height;
+            width = options.cropWidth < width - gif.cropX ? options.cropWidth : width - gif.cropX;
+            height = options.cropHeight < height - gif.cropY ? options.cropHeight : height - gif.cropY;
+        }
+        
+        gif.scaleShift = scaleShiftForDownscale(options.downscale);
+        gif.pixelFormat = options.pixelFormat;
+        gif.transparentBackground = options.transparentBackground;
+        gif.bytesPerPixel = bytesPerPixelForFormat(options.pixelFormat);
+        gif.canvasWidth = (width + (1 << gif.scaleShift) - 1) >> gif.scaleShift;
+        gif.canvasHeight = (height + (1 << gif.scaleShift) - 1) >> gif.scaleShift;
+    }
+    
+    //a palette entry holding one pixel of format, in its first bytesPerPixelForFormat(format) bytes
+    uint32 convertColor(const uint8 rgba[4], PixelFormat format)
+    {
+        uint8 pixel[4] = { rgba[0], rgba[1], rgba[2], rgba[3] };
+        switch(format)
+        {
+            case PF_BGRA8888:
+            {
+                pixel[0] = rgba[2];
+                pixel[2] = rgba[0];
+            }break;
+            case PF_RGB565:
+            {
+                uint16 packed = (uint16)(((rgba[0] >> 3) << 11) | ((rgba[1] >> 2) << 5) | (rgba[2] >> 3));
+                memcpy(pixel, &packed, sizeof(uint16));
+            }break;
+            case PF_RGBA8888Premultiplied:
+            {
+                for (uint32 i = 0; i < 3; ++i) pixel[i] = (uint8)((rgba[i] * rgba[3] + 127) / 255);
+            }break;
+            case PF_A8:
+            {
+                pixel[0] = rgba[3];
+            }break;
+            default: break;
+        }
+        
+        uint32 entry;
+        memcpy(&entry, pixel, sizeof(uint32));
+        return entry;
+    }
+    
+    //color tables are converted to 256 entry palettes of whatever pixel format is being output as soon as they're
+    //parsed, so that writing a pixel is a single load and store. Entries past the end of the color table are
+    //opaque black
+    const uint8* convertColorTable(const uint8* dataPtr, uint16 numEntries, uint32* palette, PixelFormat format)
+    {
+        for (uint32 i = 0; i < 256; ++i)
+        {
+            uint8 rgba[4] = { 0, 0, 0, 255 };
+            if (i < numEntries) memcpy(rgba, dataPtr + sizeof(Color) * i, sizeof(Color));
+            palette[i] = convertColor(rgba, format);
+        }
+        return dataPtr + sizeof(Color) * numEntries;
+    }
+    
+    const uint8* parseColorTable(const uint8* dataPtr, uint16 numEntries, uint32** outPalette, PixelFormat format)
+    {
+        *outPalette = (uint32*)GT_MALLOC(sizeof(uint32) * 256);
+        return convertColorTable(dataPtr, numEntries, *outPalette, format);
+    }
+    
+    uint16 globalColorTableEntries(const Header& header)
+    {
+        if (header.screenDescriptor.hasGlobalColorTable)
+        {
+            return 1 << (header.screenDescriptor.colorTableSize + 1);
+        }
+        return 0;
+    }
+    
+    const uint8* parseGlobalColorTable(const uint8* dataPtr, uint32** palette, const Header& header, PixelFormat format)
+    {
+        return parseColorTable(dataPtr, globalColorTableEntries(header), palette, format);
+    }
+    
+    //if gfxControlBlocks is null, graphics control blocks are only counted
+    const uint8* parseExtension(const uint8* dataPtr, uint32& totalRunTime, GraphicsControlBlock* gfxControlBlocks, uint32& numGfxBlocks)
+    {
+        uint8 extensionType = *dataPtr++;
+        uint8 blockSizeBytes = *dataPtr++;
+        
+        switch(extensionType)
+        {
+            case ET_GraphicsControl:
+            {
+                GraphicsControlBlock block;
+                uint8 packedData = *dataPtr++;
+                block.transparentFlag = (0x1 & packedData);
+                block.disposal = (DisposalMethod)((packedData >> 2) & 0x7); //top 3 bits are reserved
+                GT_CHECK(block.disposal != DM_RESTORE_TO_PREVIOUS_FRAME, "Restore clear mode is unsupported.");
+                GT_CHECK(block.disposal < DM_UNDEFINED, "Unknown or unhandled block disposal method in GraphicsControlBlock");
+                
+                block.delayTime = dataPtr[0] | (dataPtr[1] << 8); //little endian, like everything else in a gif
+                totalRunTime+=block.delayTime;
+                dataPtr+=2;
                 block.transparentColorIdx = *dataPtr++;
-                gfxControlBlocks[numGfxBlocks++] = block;
+                if (gfxControlBlocks) gfxControlBlocks[numGfxBlocks] = block;
+                numGfxBlocks++;
                 
             }break;
             case ET_ApplicationControl:
@@ -381,7 +1022,8 @@ namespace gif_read
                 //skip over this block because we don't care about whether the gif should loop or not,
                 //that will be controlled by application
                 dataPtr += blockSizeBytes; //block size only counts the bytes of the NETSCAPE2.0 string
-                uint8 subBlockSize = *dataPtr++;
+                uint8 subBlockSize = *dataPtr;
+                if (subBlockSize > 0) dataPtr++;
                 while(subBlockSize > 0)
                 {
                     dataPtr += subBlockSize;
@@ -393,7 +1035,10 @@ namespace gif_read
             case ET_Comment:
             {
                 //ignore comment block
+                //comments have no block before their sub blocks, so the block size is the size of the first
+                //one, or the block terminator if the comment is empty
                 uint8 subBlockSize = blockSizeBytes;
+                if (subBlockSize == 0) dataPtr--;
                 while(subBlockSize > 0)
                 {
                     subBlockSize = *(dataPtr += subBlockSize);
@@ -402,10 +1047,12 @@ namespace gif_read
                 
             }break;
             case ET_PlainText:
+            default:
             {
-                //ignore plaintext
+                //ignore plaintext, and skip any extension we don't know about the same way
                 dataPtr+=blockSizeBytes;
-                uint8 subBlockSize = *dataPtr++;
+                uint8 subBlockSize = *dataPtr;
+                if (subBlockSize > 0) dataPtr++;
                 while(subBlockSize > 0)
                 {
                     subBlockSize = *(dataPtr += subBlockSize);
@@ -413,10 +1060,6 @@ namespace gif_read
                 }
                 
             }break;
-            default:
-            {
-                GT_CHECK(false, "Got an unknown or invalid extension block type: %i\n", extensionType);
-            }break;
         }
         
         GT_CHECK(*dataPtr == 0x0, "Error parsing extension block, last byte wasn't 0x0");
@@ -426,21 +1069,27 @@ namespace gif_read
         
     }
     
-    const uint8* parseFrameHeader(const uint8* dataPtr, Frame& outFrame)
+    const uint8* parseImageDescriptor(const uint8* dataPtr, ImageDescriptor& outDesc)
     {
         //last byte is a packed uint8 field that needs to be parsed manually
-        memcpy(&outFrame.imageDesc, dataPtr, sizeof(ImageDescriptor)-sizeof(uint8));
+        memcpy(&outDesc, dataPtr, sizeof(ImageDescriptor)-sizeof(uint8));
         dataPtr += sizeof(ImageDescriptor)-sizeof(uint8);
         
         //had a bug where this was getting read in backwards (yay endianness) so now I'm doing it by hand
         //this shouldn't be necessary... and either this is useless and I just should re-order struct members,
         //or the other place where code is memcpying a packed buffer should be changed to this style... but
         //things appear to be working fine as is so I'm going to leave them until something breaks;
-        outFrame.imageDesc.colorTableSize = *dataPtr & 0x07; //0000 0XXX
-        outFrame.imageDesc.sortFlag = (*dataPtr & 0x20) > 0; //00X0 0000
-        outFrame.imageDesc.interlaceFlag = (*dataPtr & 0x40) > 0; //0X00 0000
-        outFrame.imageDesc.localColorTableFlag = (*dataPtr & 0x80) > 0; //X000 0000
+        outDesc.colorTableSize = *dataPtr & 0x07; //0000 0XXX
+        outDesc.sortFlag = (*dataPtr & 0x20) > 0; //00X0 0000
+        outDesc.interlaceFlag = (*dataPtr & 0x40) > 0; //0X00 0000
+        outDesc.localColorTableFlag = (*dataPtr & 0x80) > 0; //X000 0000
         dataPtr++;
+        return dataPtr;
+    }
+    
+    const uint8* parseFrameHeader(const uint8* dataPtr, Frame& outFrame, PixelFormat format)
+    {
+        dataPtr = parseImageDescriptor(dataPtr, outFrame.imageDesc);
         
         GT_CHECK(outFrame.imageDesc.interlaceFlag == 0, "Got interlaced gif - decoder does not support interlaced gifs");
         GT_CHECK(outFrame.imageDesc.sortFlag == 0, "Got sorted gif - decoder does not support sorted gifs");
@@ -448,496 +1097,2298 @@ namespace gif_read
         if (outFrame.imageDesc.localColorTableFlag)
         {
             uint16 numEntries = 1 << (outFrame.imageDesc.colorTableSize + 1);
-            outFrame.localColorTable = (Color*)GT_MALLOC(sizeof(Color) * numEntries);
-            memcpy(outFrame.localColorTable, dataPtr, sizeof(Color) * numEntries);
-            dataPtr += sizeof(Color) * numEntries;
+            dataPtr = parseColorTable(dataPtr, numEntries, &outFrame.localPalette, format);
         }
         return dataPtr;
     }
     
-    void filBufferWithBackgroundColor(uint8* frameBuffer, const GifFileData& gif)
-    {
-        const uint8* bgCol = gif.globalColorTable[gif.header.bgColor].rgb;
-        
-        for (int i = 0; i < gif.header.width * gif.header.height; i++)
-        {
-            frameBuffer[i*4] = bgCol[0];
-            frameBuffer[i*4+1] = bgCol[1];
-            frameBuffer[i*4+2] = bgCol[2];
-            frameBuffer[i*4+3] = 255;
-        }
-        
-    }
-    
-    //parses frame, but returns concatenated compressed data instead of decompressing it here
-    const uint8* parseFrameNoDecompress(const uint8* dataPtr, GifFileData& gif, uint8** outData, uint16* outSizes)
+    //moves past a frame the same way parsing one does, without reading anything out of it
+    const uint8* skipFrame(const uint8* dataPtr)
     {
-        Frame nextFrame = {0};
-        uint32& frameIdx = gif.numFrames;
-        GT_CHECK(frameIdx < MAX_GIF_FRAMES, "Gif has > 4096 frames, but the parsing code's frame buffer only holds 4096. Increase the size of the parsing code's frame array, or change the code to use a dynamically allocated array to fix.");
-        
-        dataPtr = parseFrameHeader(dataPtr, nextFrame);
-        nextFrame.lzwMinCodeSize = *dataPtr++;
-        GT_CHECK(nextFrame.lzwMinCodeSize <= 12, "Error getting LZWMinCodeSize: value should always be <=12, but current value is %i", nextFrame.lzwMinCodeSize);
-        
-        
-        //first, iterate over all subblocks to get total size
-        
-        const uint8* subBlockIterPtr = dataPtr;
-        
-        uint8 sizeOfSubBlock = *subBlockIterPtr++;
-        uint32 totalSizeOfAllCodes = 0; //needs to be 32 bit or else it will overflow on larger gifs
-        while(sizeOfSubBlock > 0)
+        uint8 packedData = dataPtr[sizeof(ImageDescriptor)-sizeof(uint8)];
+        dataPtr += sizeof(ImageDescriptor);
+        if (packedData & 0x80)
         {
-            totalSizeOfAllCodes += sizeOfSubBlock;
-            
-            subBlockIterPtr += sizeOfSubBlock;
-            sizeOfSubBlock = *subBlockIterPtr;
-            if (sizeOfSubBlock > 0) subBlockIterPtr++;
+            dataPtr += sizeof(Color) * (1 << ((packedData & 0x07) + 1));
         }
         
-        outSizes[frameIdx] = totalSizeOfAllCodes;
-        outData[frameIdx] = (uint8*)GT_MALLOC(totalSizeOfAllCodes);
-        uint32 totalCopiedBytes = 0;
-        
-        //then iterate over all subblocks again to get compressed data, now that we've allocated the buffer to hold it
-        
-        sizeOfSubBlock = *dataPtr++;
+        dataPtr++; //lzwMinCodeSize
+        uint8 sizeOfSubBlock = *dataPtr;
+        if (sizeOfSubBlock > 0) dataPtr++;
         while(sizeOfSubBlock > 0)
         {
-            memcpy(outData[frameIdx] + totalCopiedBytes, dataPtr, sizeOfSubBlock);
-            totalCopiedBytes+= sizeOfSubBlock;
             dataPtr += sizeOfSubBlock;
             sizeOfSubBlock = *dataPtr;
             if (sizeOfSubBlock > 0) dataPtr++;
         }
         
-        gif.imageData[frameIdx] = nextFrame;
-        
         GT_CHECK(*dataPtr == 0x0, "Last byte of frame isn't block terminator. Something has gone wrong");
-        
         dataPtr++;
-        frameIdx++;
         return dataPtr;
     }
     
-    //if outimages is null, this function will not convert the frame's index stream to a color array
-    const uint8* parseFrame(const uint8* dataPtr, uint8* frameBuffer, GifFileData& gif, uint8** outImages, IndexStream* outStream)
+    //walks the blocks after the global color table exactly like the ctors' parsing loops do, but only counts
+    //frames and graphics control blocks, so per frame arrays can be allocated at the size the gif needs
+    void countBlocks(const uint8* dataPtr, uint32& outNumFrames, uint32& outNumGfxBlocks)
     {
-        Frame nextFrame = {0};
-        uint32& frameIdx = gif.numFrames;
-        GT_CHECK(frameIdx < MAX_GIF_FRAMES, "Gif has > 4096 frames, but the parsing code's frame buffer only holds 4096. Increase the size of the parsing code's frame array, or change the code to use a dynamically allocated array to fix.");
+        outNumFrames = 0;
+        outNumGfxBlocks = 0;
+        uint32 runTime = 0;
         
-        dataPtr = parseFrameHeader(dataPtr, nextFrame);
-        
-        if (gif.numGfxBlocks> 0)
+        uint8 nextBlock = *dataPtr++;
+        while (nextBlock != BT_Trailer)
         {
-            if (gif.gfxControlBlocks[gif.numGfxBlocks-1].disposal == DM_CLEAR_TO_BACKGROUND)
+            if (nextBlock == BT_Extension)
+            {
+                dataPtr = parseExtension(dataPtr, runTime, nullptr, outNumGfxBlocks);
+            }
+            else if (nextBlock == BT_ImageDescriptor)
             {
-                filBufferWithBackgroundColor(frameBuffer, gif);
+                dataPtr = skipFrame(dataPtr);
+                outNumFrames++;
             }
+            
+            nextBlock = *dataPtr++;
         }
+    }
+    
+    //allocates gif's per frame arrays, and returns how many elements they hold, for any per frame arrays the
+    //caller needs. Never returns 0, so that there's always a (zeroed) first frame to look at
+    uint32 allocateFrameStorage(GifFileData& gif, const uint8* firstBlock)
+    {
+        uint32 numFrames = 0;
+        uint32 numGfxBlocks = 0;
+        countBlocks(firstBlock, numFrames, numGfxBlocks);
         
-        nextFrame.lzwMinCodeSize = *dataPtr++;
-        GT_CHECK(nextFrame.lzwMinCodeSize <= 12, "Error getting LZWMinCodeSize: value should always be <=12, but current value is %i", nextFrame.lzwMinCodeSize);
-        uint8 sizeOfSubBlock = *dataPtr++;
-        
-        DecompressionState dcState;
-        
-        IndexStream localFrameStream;
-        IndexStream& indexStream = outStream ? *outStream : localFrameStream;
-        indexStream.numIndices = 0;
-        indexStream.indices = (uint16*)GT_MALLOC(sizeof(uint16) * gif.header.width * gif.header.height);
-        
-        LZWCodeTable codeTable;
-        InitializeCodeTable(codeTable, nextFrame.imageDesc.localColorTableFlag ? nextFrame.imageDesc.colorTableSize : gif.header.screenDescriptor.colorTableSize, nextFrame.lzwMinCodeSize);
+        uint32 frameCapacity = numFrames > 0 ? numFrames : 1;
+        gif.imageData = (Frame*)GT_CALLOC(frameCapacity, sizeof(Frame));
+        gif.gfxControlBlocks = (GraphicsControlBlock*)GT_CALLOC(numGfxBlocks > 0 ? numGfxBlocks : 1, sizeof(GraphicsControlBlock));
+        return frameCapacity;
+    }
+    
+    //walks a chain of sub blocks without reading past dataEnd. On success, dataPtr is left on the block terminator
+    ParseResult validateSubBlocks(const uint8*& dataPtr, const uint8* dataEnd)
+    {
+        for(;;)
+        {
+            if (dataPtr >= dataEnd) return PR_Truncated;
+            uint8 sizeOfSubBlock = *dataPtr;
+            if (sizeOfSubBlock == 0) return PR_Ok;
+            if (dataEnd - (dataPtr + 1) < sizeOfSubBlock) return PR_Truncated;
+            dataPtr += sizeOfSubBlock + 1;
+        }
+    }
+    
+    //header and global color table
+    ParseResult validateHeader(const uint8*& dataPtr, const uint8* dataEnd)
+    {
+        if ((uint32)(dataEnd - dataPtr) < sizeof(Header)) return PR_Truncated;
+        Header header;
+        parseHeader(dataPtr, header);
+        if (memcmp(header.signature, "GIF", 3) != 0 || (memcmp(header.version, "87a", 3) != 0 && memcmp(header.version, "89a", 3) != 0))
+        {
+            return PR_Corrupt;
+        }
         
-        while(sizeOfSubBlock > 0)
+        uint32 colorTableBytes = 0;
+        if (header.screenDescriptor.hasGlobalColorTable)
         {
-            dcState = compressedDataToIndexStream(dataPtr, sizeOfSubBlock, nextFrame.imageDesc.localColorTableFlag ? nextFrame.imageDesc.colorTableSize : gif.header.screenDescriptor.colorTableSize, nextFrame.lzwMinCodeSize, codeTable, dcState, indexStream);
-            
-            dataPtr += sizeOfSubBlock;
-            sizeOfSubBlock = *dataPtr;
-            if (sizeOfSubBlock > 0) dataPtr++;
+            colorTableBytes = sizeof(Color) * (1 << (header.screenDescriptor.colorTableSize + 1));
         }
+        if ((uint32)(dataEnd - dataPtr) < sizeof(Header) + colorTableBytes) return PR_Truncated;
+        dataPtr += sizeof(Header) + colorTableBytes;
+        return PR_Ok;
+    }
+    
+    //an extension block, starting after its 0x21 byte and ending after its block terminator
+    ParseResult validateExtension(const uint8*& dataPtr, const uint8* dataEnd)
+    {
+        if (dataEnd - dataPtr < 2) return PR_Truncated;
+        uint8 extensionType = dataPtr[0];
+        uint8 blockSizeBytes = dataPtr[1];
+        const uint8* blockPtr = dataPtr + 2;
         
-        if (outImages != nullptr)
+        if (extensionType == ET_GraphicsControl)
         {
-            uint32 frameSizeBytes = sizeof(uint8) * 4 * gif.header.width * gif.header.height;
-            outImages[frameIdx] = (uint8*)GT_MALLOC(frameSizeBytes);
-            
-            uint32 transparentIdx = gif.numGfxBlocks > 0 ? gif.gfxControlBlocks[frameIdx].transparentColorIdx : NO_CODE;
-            indexStreamToColorArray(indexStream, nextFrame.localColorTable ? nextFrame.localColorTable : gif.globalColorTable, frameBuffer, transparentIdx, nextFrame, gif.header);
+            //parseExtension reads a fixed size block here, regardless of blockSizeBytes
+            if (blockSizeBytes != 4) return PR_Corrupt;
+            if (dataEnd - blockPtr < 5) return PR_Truncated;
             
-            memcpy(outImages[frameIdx], frameBuffer, frameSizeBytes);
+            uint8 disposal = (blockPtr[0] >> 2) & 0x7;
+            if (disposal == DM_RESTORE_TO_PREVIOUS_FRAME) return PR_Unsupported;
+            if (disposal >= DM_UNDEFINED) return PR_Corrupt;
+            if (blockPtr[4] != 0x0) return PR_Corrupt;
+            dataPtr = blockPtr + 5;
+            return PR_Ok;
         }
         
-        gif.imageData[frameIdx] = nextFrame;
+        //comments start their first sub block with what would be the block size byte, everything
+        //else skips a block of blockSizeBytes before its sub blocks
+        if (extensionType == ET_Comment) blockPtr--;
+        else if (dataEnd - blockPtr < blockSizeBytes) return PR_Truncated;
+        else blockPtr += blockSizeBytes;
         
-        GT_CHECK(*dataPtr == 0x0, "Last byte of frame isn't block terminator. Something has gone wrong");
+        ParseResult result = validateSubBlocks(blockPtr, dataEnd);
+        if (result != PR_Ok) return result;
+        dataPtr = blockPtr + 1;
+        return PR_Ok;
+    }
+    
+    //image descriptor, local color table and lzw min code size, starting after the 0x2C byte
+    ParseResult validateFrameHeader(const uint8*& dataPtr, const uint8* dataEnd)
+    {
+        if ((uint32)(dataEnd - dataPtr) < sizeof(ImageDescriptor)) return PR_Truncated;
+        uint8 packedData = dataPtr[sizeof(ImageDescriptor)-sizeof(uint8)];
+        if (packedData & 0x60) return PR_Unsupported; //interlaced or sorted
         
-        if (!outStream) GT_FREE(indexStream.indices);
+        uint32 colorTableBytes = 0;
+        if (packedData & 0x80)
+        {
+            colorTableBytes = sizeof(Color) * (1 << ((packedData & 0x07) + 1));
+        }
         
-        dataPtr++;
-        frameIdx++;
-        return dataPtr;
+        uint32 headerBytes = sizeof(ImageDescriptor) + colorTableBytes + 1;
+        if ((uint32)(dataEnd - dataPtr) < headerBytes) return PR_Truncated;
+        if (dataPtr[headerBytes-1] > MAX_LZW_MIN_CODE_SIZE) return PR_Corrupt;
+        dataPtr += headerBytes;
+        return PR_Ok;
     }
-}
-
-#pragma mark - GIF class methods
-namespace gif_read
-{
-    struct GIFImpl
-    {
-        GifFileData file;
-        uint8* images[MAX_GIF_FRAMES];
-    };
     
-    GIF::GIF( const uint8* gifData )
+    //checks everything the parsing functions will read is inside the data, and is something they can parse,
+    //so that parsing and decoding a gif that passes don't need any bounds checks of their own. Corrupt LZW
+    //data isn't checked here, since the decoders already stop at the first code that makes no sense
+    ParseResult validateGifData(const uint8* data, uint32 size)
     {
-        _impl = (GIFImpl*)GT_CALLOC(1,sizeof(GIFImpl));
-        GifFileData& gif = _impl->file;
-        gif.numFrames = 0;
-        
-        const uint8* ptr = nullptr;
-        ptr = parseHeader(gifData, gif.header);
-        ptr = parseGlobalColorTable(ptr, &gif.globalColorTable, gif.header);
+        const uint8* dataPtr = data;
+        const uint8* dataEnd = data + size;
         
-        //working buffer for frame data
-        uint8* frameBuffer = (uint8*)GT_MALLOC(gif.header.width * gif.header.height * 4 * sizeof(uint8));
-        uint8 nextBlock = *ptr++;
-        while (nextBlock != BT_Trailer)
+        ParseResult result = validateHeader(dataPtr, dataEnd);
+        while (result == PR_Ok)
         {
-            if (nextBlock == BT_Extension)
+            if (dataPtr >= dataEnd) return PR_Truncated;
+            uint8 nextBlock = *dataPtr++;
+            
+            if (nextBlock == BT_Trailer)
             {
-                ptr = parseExtension(ptr, gif.totalRunTime, gif.gfxControlBlocks, gif.numGfxBlocks);
+                return PR_Ok;
+            }
+            else if (nextBlock == BT_Extension)
+            {
+                result = validateExtension(dataPtr, dataEnd);
             }
             else if (nextBlock == BT_ImageDescriptor)
             {
-                ptr = parseFrame(ptr, frameBuffer, gif, _impl->images, nullptr); //we want to save all images, but discard index streams
+                result = validateFrameHeader(dataPtr, dataEnd);
+                if (result == PR_Ok) result = validateSubBlocks(dataPtr, dataEnd);
+                dataPtr++;
             }
             else
             {
-                GT_CHECK(false, "Got bad block format byte. Code expects each block to start with either 0x21, 0x2C or 0x3B");
+                return PR_Corrupt;
             }
-            
-            nextBlock = *ptr++;
-        }
-        
-        GT_FREE(frameBuffer);
-        
-        for (uint32 i = 0; i < gif.numFrames; ++i)
-        {
-            if (gif.imageData[i].localColorTable) GT_FREE(gif.imageData[i].localColorTable);
         }
+        return result;
     }
     
-    const uint8* GIF::getFrame(uint32 frameIndex) const
+    //loop count from a NETSCAPE2.0 (or identical ANIMEXTS1.0) application extension that's already been validated,
+    //starting at its extension type byte. Returns -1 for any other application extension
+    int32 parseLoopCount(const uint8* dataPtr)
     {
-        GT_CHECK(frameIndex < _impl->file.numFrames, "Out-of-bounds error when trying to get Gif frame");
-        return _impl->images[frameIndex];
+        uint8 blockSizeBytes = dataPtr[1];
+        const uint8* identifier = dataPtr + 2;
+        if (blockSizeBytes != 11 || (memcmp(identifier, "NETSCAPE2.0", 11) != 0 && memcmp(identifier, "ANIMEXTS1.0", 11) != 0))
+        {
+            return -1;
+        }
+        
+        //sub block id 1 holds the loop count
+        const uint8* subBlock = identifier + blockSizeBytes;
+        if (subBlock[0] < 3 || subBlock[1] != 1) return -1;
+        return subBlock[2] | (subBlock[3] << 8);
     }
     
-    const uint8* GIF::getFrameAtTime(float time, bool looping) const
+    ParseResult probe(const uint8* gifData, uint32 fileSize, GifInfo& outInfo, FrameInfo* outFrames, uint32 maxFrames)
     {
-        GT_CHECK(time >= 0, "Attempting to get a gif frame at a negative time (%f)", time);
-        GifFileData& gif = _impl->file;
-        uint32 runTime = gif.totalRunTime;
-        if (runTime == 0) return _impl->images[0];
+        outInfo = GifInfo();
         
-        uint32 runningTime = 0;
-        uint32 hundredths = looping ? (uint32)(time * 100) % gif.totalRunTime : (time) * 100;
+        const uint8* dataPtr = gifData;
+        const uint8* dataEnd = gifData + fileSize;
+        
+        ParseResult result = validateHeader(dataPtr, dataEnd);
+        if (result != PR_Ok) return result;
         
-        for (uint32 i = 0; i < gif.numGfxBlocks; ++i)
+        Header header;
+        parseHeader(gifData, header);
+        outInfo.width = header.width;
+        outInfo.height = header.height;
+        
+        //the graphics control block (if any) that applies to the next frame
+        GraphicsControlBlock gfxBlock = {0};
+        uint32 numGfxBlocks = 0;
+        uint32 unusedRunTime = 0;
+        
+        while (result == PR_Ok)
         {
-            runningTime += gif.gfxControlBlocks[i].delayTime;
-            if (hundredths <= runningTime) return _impl->images[i];
+            if (dataPtr >= dataEnd) return PR_Truncated;
+            uint8 nextBlock = *dataPtr++;
+            
+            if (nextBlock == BT_Trailer)
+            {
+                return PR_Ok;
+            }
+            else if (nextBlock == BT_Extension)
+            {
+                const uint8* extension = dataPtr;
+                result = validateExtension(dataPtr, dataEnd);
+                if (result != PR_Ok) break;
+                
+                if (extension[0] == ET_GraphicsControl)
+                {
+                    numGfxBlocks = 0;
+                    parseExtension(extension, unusedRunTime, &gfxBlock, numGfxBlocks);
+                }
+                else if (extension[0] == ET_ApplicationControl)
+                {
+                    int32 loopCount = parseLoopCount(extension);
+                    if (loopCount >= 0) outInfo.loopCount = loopCount;
+                }
+            }
+            else if (nextBlock == BT_ImageDescriptor)
+            {
+                const uint8* frameHeader = dataPtr;
+                result = validateFrameHeader(dataPtr, dataEnd);
+                if (result == PR_Ok) result = validateSubBlocks(dataPtr, dataEnd);
+                if (result != PR_Ok) break;
+                dataPtr++;
+                
+                uint16 delayTime = numGfxBlocks > 0 ? gfxBlock.delayTime : 0;
+                if (outFrames && outInfo.numFrames < maxFrames)
+                {
+                    ImageDescriptor desc;
+                    parseImageDescriptor(frameHeader, desc);
+                    
+                    FrameInfo& frame = outFrames[outInfo.numFrames];
+                    frame.xPos = desc.xPos;
+                    frame.yPos = desc.yPos;
+                    frame.width = desc.width;
+                    frame.height = desc.height;
+                    frame.delayTime = delayTime;
+                    frame.hasTransparency = numGfxBlocks > 0 && gfxBlock.transparentFlag;
+                    frame.hasLocalColorTable = desc.localColorTableFlag;
+                }
+                
+                outInfo.totalRunTime += delayTime;
+                outInfo.numFrames++;
+                numGfxBlocks = 0;
+            }
+            else
+            {
+                return PR_Corrupt;
+            }
         }
-        
-        return _impl->images[gif.numFrames-1];
-    }
-    
-    uint32 GIF::getWidth() const
-    {
-        return _impl->file.header.width;
+        return result;
     }
     
-    uint32 GIF::getHeight() const
+    void filBufferWithBackgroundColor(uint8* frameBuffer, const GifFileData& gif)
     {
-        return _impl->file.header.height;
+        //every pixel format stores transparent black as all zeros
+        uint32 bgCol = gif.transparentBackground ? 0 : gif.globalPalette[gif.header.bgColor];
+        uint32 numPixels = gif.canvasWidth * gif.canvasHeight;
+        
+        if (gif.bytesPerPixel == 4)
+        {
+            uint32* pixels = (uint32*)frameBuffer;
+            for (uint32 i = 0; i < numPixels; i++)
+            {
+                pixels[i] = bgCol;
+            }
+        }
+        else
+        {
+            for (uint32 i = 0; i < numPixels; i++)
+            {
+                memcpy(frameBuffer + i * gif.bytesPerPixel, &bgCol, gif.bytesPerPixel);
+            }
+        }
+    }
+    
+    ParseResult decodeFirstFrame(const uint8* gifData, uint32 fileSize, uint8*& outRGBA, uint32& outWidth, uint32& outHeight, const DecodeOptions& options)
+    {
+        outRGBA = nullptr;
+        outWidth = 0;
+        outHeight = 0;
+        
+        const uint8* dataPtr = gifData;
+        const uint8* dataEnd = gifData + fileSize;
+        
+        ParseResult result = validateHeader(dataPtr, dataEnd);
+        if (result != PR_Ok) return result;
+        
+        //palettes and the graphics control block are kept on the stack, gif just points at them
+        uint32 globalPalette[256];
+        uint32 localPalette[256];
+        GraphicsControlBlock gfxBlock = {0};
+        
+        GifFileData gif;
+        gif.decoder = options.decoder;
+        gif.globalPalette = globalPalette;
+        gif.gfxControlBlocks = &gfxBlock;
+        gif.totalRunTime = 0;
+        
+        const uint8* ptr = parseHeader(gifData, gif.header);
+        setupCanvas(gif, options);
+        convertColorTable(ptr, globalColorTableEntries(gif.header), globalPalette, gif.pixelFormat);
+        
+        //only the blocks up to the end of the first frame get validated, nothing after that is ever read.
+        //gfxBlock ends up holding the last graphics control block before the frame
+        const uint8* frameHeader = nullptr;
+        while (frameHeader == nullptr)
+        {
+            if (dataPtr >= dataEnd) return PR_Truncated;
+            uint8 nextBlock = *dataPtr++;
+            
+            if (nextBlock == BT_Trailer)
+            {
+                break;
+            }
+            else if (nextBlock == BT_Extension)
+            {
+                const uint8* extension = dataPtr;
+                result = validateExtension(dataPtr, dataEnd);
+                if (result != PR_Ok) return result;
+                
+                if (extension[0] == ET_GraphicsControl)
+                {
+                    gif.numGfxBlocks = 0;
+                    parseExtension(extension, gif.totalRunTime, &gfxBlock, gif.numGfxBlocks);
+                }
+            }
+            else if (nextBlock == BT_ImageDescriptor)
+            {
+                frameHeader = dataPtr;
+                result = validateFrameHeader(dataPtr, dataEnd);
+                if (result == PR_Ok) result = validateSubBlocks(dataPtr, dataEnd);
+                if (result != PR_Ok) return result;
+            }
+            else
+            {
+                return PR_Corrupt;
+            }
+        }
+        
+        Frame frame = {0};
+        uint32 indexStreamSize = 0;
+        if (frameHeader)
+        {
+            ptr = parseImageDescriptor(frameHeader, frame.imageDesc);
+            if (frame.imageDesc.localColorTableFlag)
+            {
+                ptr = convertColorTable(ptr, 1 << (frame.imageDesc.colorTableSize + 1), localPalette, gif.pixelFormat);
+                frame.localPalette = localPalette;
+            }
+            frame.lzwMinCodeSize = *ptr++;
+            indexStreamSize = indexStreamSizeForFrame(frame, gif.decoder);
+        }
+        
+        //the index stream is tacked onto the end of the output, so that's the only allocation. It's cut off
+        //again once the frame is decoded
+        uint32 canvasBytes = gif.canvasWidth * gif.canvasHeight * gif.bytesPerPixel;
+        uint8* canvas = (uint8*)GT_MALLOC(canvasBytes + indexStreamSize);
+        filBufferWithBackgroundColor(canvas, gif);
+        
+        if (frameHeader)
+        {
+            IndexStream indexStream;
+            indexStream.indices = canvas + canvasBytes;
+            indexStream.maxIndices = indexStreamSize;
+            
+            FrameTarget target;
+            setupFrameTarget(target, canvas, gif, frame, 0);
+            
+            LZWTables tables;
+            tables.decoder = gif.decoder;
+            InitializeTables(tables, frame.imageDesc.localColorTableFlag ? frame.imageDesc.colorTableSize : gif.header.screenDescriptor.colorTableSize, frame.lzwMinCodeSize);
+            
+            decompressSubBlocks(ptr, frame.lzwMinCodeSize, tables, DecompressionState(), indexStream, &target);
+            compositePartialRow(indexStream, target);
+            
+            //if shrinking fails, the original buffer is still valid, just bigger than it needs to be
+            uint8* shrunk = canvasBytes > 0 ? (uint8*)GT_REALLOC(canvas, canvasBytes) : nullptr;
+            if (shrunk) canvas = shrunk;
+        }
+        
+        outRGBA = canvas;
+        outWidth = gif.canvasWidth;
+        outHeight = gif.canvasHeight;
+        return PR_Ok;
+    }
+    
+    void freeFrame(uint8* frame)
+    {
+        GT_FREE(frame);
+    }
+    
+    //the frame about to be parsed clears to the background color if the last graphics control block says so
+    bool frameClearsCanvas(const GifFileData& gif)
+    {
+        return gif.numGfxBlocks > 0 && gif.gfxControlBlocks[gif.numGfxBlocks-1].disposal == DM_CLEAR_TO_BACKGROUND;
+    }
+    
+    //decompresses all of a frame's sub blocks into indexStream without compositing anything. Returns a pointer
+    //to the block terminator after the last sub block
+    const uint8* decompressFrameIndices(const uint8* subBlocks, const Frame& frame, const GifFileData& gif, IndexStream& indexStream)
+    {
+        reserveIndexStream(indexStream, frame.imageDesc.width * frame.imageDesc.height);
+        indexStream.numIndices = 0;
+        
+        LZWTables tables;
+        tables.decoder = gif.decoder;
+        InitializeTables(tables, frame.imageDesc.localColorTableFlag ? frame.imageDesc.colorTableSize : gif.header.screenDescriptor.colorTableSize, frame.lzwMinCodeSize);
+        
+        return decompressSubBlocks(subBlocks, frame.lzwMinCodeSize, tables, DecompressionState(), indexStream, nullptr);
+    }
+    
+    const uint32 NO_PALETTE = 0xFFFFFFFF; //palette id of a frame stored in color instead of as indices
+    
+    //canvas for gifs that store frames as palette indices. A frame with its own color table can still leave
+    //pixels from the frames before it on the canvas, so frames can't just keep indices into their own color
+    //tables. Instead the canvas has a palette of its own, and each frame's colors get merged into it
+    struct IndexedCanvas
+    {
+        uint32 palette[256];
+        const uint32* source; //the color table palette is identical to, or null once other colors are merged in
+        uint8 remap[256]; //from the current frame's color table to palette
+        uint32 entryMask; //the bytes of a palette entry that hold a pixel, which are all a merge compares
+        
+        //canvas sized scratch space for working out which colors a merge has to keep
+        uint8* coverage;
+        uint8* frameLayer;
+        
+        //more than 256 colors visible at once can't be stored as indices. From the frame that needs more until
+        //the canvas is cleared or back down to 256 colors, frames are composited onto colorCanvas (in the GIF's
+        //pixel format) instead, and stored the same way they would be without storeIndices
+        uint8* colorCanvas;
+        uint32 colorBytesPerPixel;
+        bool usingColorCanvas;
+        
+        uint32** palettes; //every version of palette that a frame has been stored with
+        uint32 numPalettes;
+        uint32* framePaletteIds; //NO_PALETTE for frames stored in color
+    };
+    
+    //fills the canvas with the background color index. With a transparent background, that slot of the canvas
+    //palette is made transparent, which means the palette no longer matches any color table, so frames drawn
+    //on it go through mergeFramePalette (and get their own slot for the real background color if they use it)
+    void clearIndexedCanvas(IndexedCanvas& indexed, uint8* canvas, const GifFileData& gif)
+    {
+        memcpy(indexed.palette, gif.globalPalette, sizeof(indexed.palette));
+        indexed.source = gif.globalPalette;
+        memset(canvas, gif.header.bgColor, gif.canvasWidth * gif.canvasHeight);
+        indexed.usingColorCanvas = false;
+        
+        if (gif.transparentBackground)
+        {
+            indexed.palette[gif.header.bgColor] = 0;
+            indexed.source = nullptr;
+        }
+    }
+    
+    void initIndexedCanvas(IndexedCanvas& indexed, uint8* canvas, const GifFileData& gif, uint32 frameCapacity)
+    {
+        uint32 numPixels = gif.canvasWidth * gif.canvasHeight;
+        clearIndexedCanvas(indexed, canvas, gif);
+        
+        indexed.coverage = (uint8*)GT_MALLOC(numPixels);
+        indexed.frameLayer = (uint8*)GT_MALLOC(numPixels);
+        indexed.colorCanvas = nullptr; //only allocated if a frame needs it
+        indexed.colorBytesPerPixel = bytesPerPixelForFormat(gif.pixelFormat);
+        indexed.entryMask = indexed.colorBytesPerPixel < 4 ? (1u << (8 * indexed.colorBytesPerPixel)) - 1 : 0xFFFFFFFF;
+        
+        indexed.palettes = (uint32**)GT_CALLOC(frameCapacity, sizeof(uint32*));
+        indexed.numPalettes = 0;
+        indexed.framePaletteIds = (uint32*)GT_CALLOC(frameCapacity, sizeof(uint32));
+    }
+    
+    //gives frameIdx the current palette, adding it to the list if it's changed since the last frame
+    void recordFramePalette(IndexedCanvas& indexed, uint32 frameIdx)
+    {
+        if (indexed.numPalettes == 0 || memcmp(indexed.palettes[indexed.numPalettes-1], indexed.palette, sizeof(indexed.palette)) != 0)
+        {
+            uint32* palette = (uint32*)GT_MALLOC(sizeof(indexed.palette));
+            memcpy(palette, indexed.palette, sizeof(indexed.palette));
+            indexed.palettes[indexed.numPalettes++] = palette;
+        }
+        indexed.framePaletteIds[frameIdx] = indexed.numPalettes - 1;
+    }
+    
+    //call after setupFrameTarget. Clears the canvas if the frame asks for it, and if the frame's color table is
+    //the one the canvas palette came from, sets target up to write indices straight into the canvas. Returns
+    //false if the frame's colors need merging into the canvas palette instead, which needs all of its indices
+    //before anything is composited (see mergeFramePalette)
+    bool beginIndexedFrame(IndexedCanvas& indexed, FrameTarget& target, const GifFileData& gif, bool clearCanvas, uint32 frameIdx)
+    {
+        if (clearCanvas) clearIndexedCanvas(indexed, target.canvas, gif);
+        
+        target.remap = indexed.remap;
+        if (target.palette != indexed.source) return false;
+        
+        for (uint32 i = 0; i < 256; ++i) indexed.remap[i] = (uint8)i;
+        recordFramePalette(indexed, frameIdx);
+        return true;
+    }
+    
+    //points remap at a slot holding each color the frame draws, reusing slots that already have that color,
+    //then slots no pixel left visible on the canvas uses. Returns false if that runs out (ie - more than 256
+    //colors would be visible at once, which 8 bits can't represent), in which case the frame has to go on the
+    //color canvas. Slots visible pixels use are never changed, so the canvas still has the right colors
+    bool mergeFramePalette(IndexedCanvas& indexed, const FrameTarget& target, const GifFileData& gif, const IndexStream& frameIndices, uint32 frameIdx)
+    {
+        uint32 numPixels = gif.canvasWidth * gif.canvasHeight;
+        
+        //composite the frame twice off to the side, once to find which pixels it covers, and once to find which
+        //of its colors end up on the canvas
+        uint8 ones[256];
+        memset(ones, 1, sizeof(ones));
+        memset(indexed.coverage, 0, numPixels);
+        for (uint32 i = 0; i < 256; ++i) indexed.remap[i] = (uint8)i;
+        
+        FrameTarget scratch = target;
+        scratch.canvas = indexed.coverage;
+        scratch.remap = ones;
+        IndexStream stream = frameIndices;
+        compositeCompletedRows(stream, scratch);
+        compositePartialRow(stream, scratch);
+        
+        scratch = target;
+        scratch.canvas = indexed.frameLayer;
+        scratch.remap = indexed.remap;
+        compositeCompletedRows(stream, scratch);
+        compositePartialRow(stream, scratch);
+        
+        bool claimed[256] = {false};
+        bool used[256] = {false};
+        for (uint32 i = 0; i < numPixels; ++i)
+        {
+            if (indexed.coverage[i]) used[indexed.frameLayer[i]] = true;
+            else claimed[target.canvas[i]] = true;
+        }
+        
+        const uint32* framePalette = target.palette;
+        bool mapped[256] = {false};
+        for (uint32 i = 0; i < 256; ++i)
+        {
+            if (!used[i]) continue;
+            for (uint32 slot = 0; slot < 256; ++slot)
+            {
+                if ((indexed.palette[slot] ^ framePalette[i]) & indexed.entryMask) continue;
+                indexed.remap[i] = (uint8)slot;
+                claimed[slot] = true;
+                mapped[i] = true;
+                break;
+            }
+        }
+        
+        uint32 freeSlot = 0;
+        for (uint32 i = 0; i < 256; ++i)
+        {
+            if (!used[i] || mapped[i]) continue;
+            
+            //a color that appears more than once in the frame's color table only needs one slot
+            bool duplicate = false;
+            for (uint32 j = 0; j < i && !duplicate; ++j)
+            {
+                if (mapped[j] && !((framePalette[j] ^ framePalette[i]) & indexed.entryMask))
+                {
+                    indexed.remap[i] = indexed.remap[j];
+                    duplicate = true;
+                }
+            }
+            
+            if (!duplicate)
+            {
+                while (freeSlot < 256 && claimed[freeSlot]) freeSlot++;
+                if (freeSlot == 256) return false;
+                
+                indexed.palette[freeSlot] = framePalette[i];
+                indexed.remap[i] = (uint8)freeSlot;
+                claimed[freeSlot] = true;
+            }
+            mapped[i] = true;
+        }
+        
+        indexed.source = memcmp(indexed.palette, framePalette, sizeof(indexed.palette)) == 0 ? framePalette : nullptr;
+        recordFramePalette(indexed, frameIdx);
+        return true;
+    }
+    
+    //expands the index canvas into colorCanvas, which frames are composited onto from then on
+    void useColorCanvas(IndexedCanvas& indexed, const uint8* canvas, const GifFileData& gif)
+    {
+        uint32 numPixels = gif.canvasWidth * gif.canvasHeight;
+        if (!indexed.colorCanvas) indexed.colorCanvas = (uint8*)GT_MALLOC(numPixels * indexed.colorBytesPerPixel);
+        
+        expandRowToFormat(indexed.colorCanvas, canvas, numPixels, indexed.palette, NO_CODE, indexed.colorBytesPerPixel);
+        indexed.usingColorCanvas = true;
+        indexed.source = nullptr;
+    }
+    
+    //if colorCanvas is back down to 256 colors or less, gives the canvas a palette of exactly those colors and
+    //converts colorCanvas back to indices. Returns false (leaving the canvas in color) if it isn't
+    bool leaveColorCanvas(IndexedCanvas& indexed, uint8* canvas, const GifFileData& gif, uint32 frameIdx)
+    {
+        uint32 numPixels = gif.canvasWidth * gif.canvasHeight;
+        uint32 bytesPerPixel = indexed.colorBytesPerPixel;
+        
+        //open addressed, and twice the size of the most colors it can hold, so probes stay short. The index
+        //canvas isn't used while colorCanvas is, so it's fine to write to it before knowing if this will work
+        uint32 colors[512];
+        uint16 slots[512];
+        memset(slots, 0xFF, sizeof(slots));
+        uint32 palette[256] = {0};
+        uint32 numColors = 0;
+        
+        for (uint32 i = 0; i < numPixels; ++i)
+        {
+            uint32 color = 0;
+            memcpy(&color, indexed.colorCanvas + i * bytesPerPixel, bytesPerPixel);
+            
+            uint32 hash = (color * 2654435761u) >> 23;
+            while (slots[hash] != 0xFFFF && colors[hash] != color) hash = (hash + 1) & 511;
+            if (slots[hash] == 0xFFFF)
+            {
+                if (numColors == 256) return false;
+                colors[hash] = color;
+                slots[hash] = (uint16)numColors;
+                palette[numColors++] = color;
+            }
+            canvas[i] = (uint8)slots[hash];
+        }
+        
+        memcpy(indexed.palette, palette, sizeof(indexed.palette));
+        indexed.usingColorCanvas = false;
+        recordFramePalette(indexed, frameIdx);
+        return true;
+    }
+    
+    //composites a frame that beginIndexedFrame couldn't write straight to the canvas, once all of its indices
+    //have been decompressed. It ends up on the index canvas if its colors fit in the canvas palette, otherwise
+    //on colorCanvas
+    void compositeMergedFrame(IndexedCanvas& indexed, FrameTarget& target, const GifFileData& gif, IndexStream& frameIndices, uint32 frameIdx)
+    {
+        if (!indexed.usingColorCanvas)
+        {
+            if (mergeFramePalette(indexed, target, gif, frameIndices, frameIdx))
+            {
+                compositeCompletedRows(frameIndices, target);
+                compositePartialRow(frameIndices, target);
+                return;
+            }
+            useColorCanvas(indexed, target.canvas, gif);
+        }
+        
+        FrameTarget colorTarget = target;
+        colorTarget.canvas = indexed.colorCanvas;
+        colorTarget.remap = nullptr;
+        colorTarget.bytesPerPixel = indexed.colorBytesPerPixel;
+        compositeCompletedRows(frameIndices, colorTarget);
+        compositePartialRow(frameIndices, colorTarget);
+        
+        if (!leaveColorCanvas(indexed, target.canvas, gif, frameIdx)) indexed.framePaletteIds[frameIdx] = NO_PALETTE;
+    }
+    
+    //frames of an indexed gif are copied out of colorCanvas instead while it's in use
+    void copyOutFrame(const uint8* frameBuffer, const GifFileData& gif, uint8** outImages, uint32 frameIdx, const IndexedCanvas* indexed = nullptr)
+    {
+        uint32 bytesPerPixel = gif.bytesPerPixel;
+        if (indexed && indexed->usingColorCanvas)
+        {
+            frameBuffer = indexed->colorCanvas;
+            bytesPerPixel = indexed->colorBytesPerPixel;
+        }
+        
+        uint32 frameSizeBytes = sizeof(uint8) * bytesPerPixel * gif.canvasWidth * gif.canvasHeight;
+        outImages[frameIdx] = (uint8*)GT_MALLOC(frameSizeBytes);
+        memcpy(outImages[frameIdx], frameBuffer, frameSizeBytes);
+    }
+    
+    //parses frame, but returns concatenated compressed data instead of decompressing it here
+    const uint8* parseFrameNoDecompress(const uint8* dataPtr, GifFileData& gif, uint8** outData, uint32* outSizes)
+    {
+        Frame nextFrame = {0};
+        uint32& frameIdx = gif.numFrames;
+        
+        dataPtr = parseFrameHeader(dataPtr, nextFrame, gif.pixelFormat);
+        nextFrame.lzwMinCodeSize = *dataPtr++;
+        GT_CHECK(nextFrame.lzwMinCodeSize <= MAX_LZW_MIN_CODE_SIZE, "Error getting LZWMinCodeSize: value should always be <=11, but current value is %i", nextFrame.lzwMinCodeSize);
+        
+        
+        //first, iterate over all subblocks to get total size
+        
+        const uint8* subBlockIterPtr = dataPtr;
+        
+        uint8 sizeOfSubBlock = *subBlockIterPtr;
+        if (sizeOfSubBlock > 0) subBlockIterPtr++;
+        uint32 totalSizeOfAllCodes = 0; //needs to be 32 bit or else it will overflow on larger gifs
+        while(sizeOfSubBlock > 0)
+        {
+            totalSizeOfAllCodes += sizeOfSubBlock;
+            
+            subBlockIterPtr += sizeOfSubBlock;
+            sizeOfSubBlock = *subBlockIterPtr;
+            if (sizeOfSubBlock > 0) subBlockIterPtr++;
+        }
+        
+        outSizes[frameIdx] = totalSizeOfAllCodes;
+        outData[frameIdx] = (uint8*)GT_MALLOC(totalSizeOfAllCodes);
+        uint32 totalCopiedBytes = 0;
+        
+        //then iterate over all subblocks again to get compressed data, now that we've allocated the buffer to hold it
+        
+        sizeOfSubBlock = *dataPtr;
+        if (sizeOfSubBlock > 0) dataPtr++;
+        while(sizeOfSubBlock > 0)
+        {
+            memcpy(outData[frameIdx] + totalCopiedBytes, dataPtr, sizeOfSubBlock);
+            totalCopiedBytes+= sizeOfSubBlock;
+            dataPtr += sizeOfSubBlock;
+            sizeOfSubBlock = *dataPtr;
+            if (sizeOfSubBlock > 0) dataPtr++;
+        }
+        
+        gif.imageData[frameIdx] = nextFrame;
+        
+        GT_CHECK(*dataPtr == 0x0, "Last byte of frame isn't block terminator. Something has gone wrong");
+        
+        dataPtr++;
+        frameIdx++;
+        return dataPtr;
+    }
+    
+    //decodes the frame straight into frameBuffer. If outImages is null, the result isn't copied out of frameBuffer
+    const uint8* parseFrame(const uint8* dataPtr, uint8* frameBuffer, GifFileData& gif, uint8** outImages, IndexStream& indexStream, IndexedCanvas* indexed)
+    {
+        Frame nextFrame = {0};
+        uint32& frameIdx = gif.numFrames;
+        
+        dataPtr = parseFrameHeader(dataPtr, nextFrame, gif.pixelFormat);
+        
+        nextFrame.lzwMinCodeSize = *dataPtr++;
+        GT_CHECK(nextFrame.lzwMinCodeSize <= MAX_LZW_MIN_CODE_SIZE, "Error getting LZWMinCodeSize: value should always be <=11, but current value is %i", nextFrame.lzwMinCodeSize);
+        
+        reserveIndexStream(indexStream, indexStreamSizeForFrame(nextFrame, gif.decoder));
+        indexStream.numIndices = 0;
+        
+        FrameTarget target;
+        setupFrameTarget(target, frameBuffer, gif, nextFrame, frameIdx);
+        
+        bool clearCanvas = frameClearsCanvas(gif);
+        if (indexed && !beginIndexedFrame(*indexed, target, gif, clearCanvas, frameIdx))
+        {
+            dataPtr = decompressFrameIndices(dataPtr, nextFrame, gif, indexStream);
+            compositeMergedFrame(*indexed, target, gif, indexStream, frameIdx);
+        }
+        else
+        {
+            if (clearCanvas && !indexed) filBufferWithBackgroundColor(frameBuffer, gif);
+            
+            LZWTables tables;
+            tables.decoder = gif.decoder;
+            InitializeTables(tables, nextFrame.imageDesc.localColorTableFlag ? nextFrame.imageDesc.colorTableSize : gif.header.screenDescriptor.colorTableSize, nextFrame.lzwMinCodeSize);
+            
+            dataPtr = decompressSubBlocks(dataPtr, nextFrame.lzwMinCodeSize, tables, DecompressionState(), indexStream, &target);
+            compositePartialRow(indexStream, target);
+        }
+        
+        if (outImages != nullptr)
+        {
+            copyOutFrame(frameBuffer, gif, outImages, frameIdx, indexed);
+        }
+        
+        gif.imageData[frameIdx] = nextFrame;
+        
+        GT_CHECK(*dataPtr == 0x0, "Last byte of frame isn't block terminator. Something has gone wrong");
+        
+        dataPtr++;
+        frameIdx++;
+        return dataPtr;
+    }
+    
+    //everything a frame needs from the blocks parsed before it, so that it can be decompressed out of order
+    struct PendingFrame
+    {
+        const uint8* subBlocks;
+        uint32 transparentIdx;
+        bool clearCanvas;
+    };
+    
+    //parses frame, but only records where its sub blocks start instead of decompressing or copying them
+    const uint8* parseFrameSkipData(const uint8* dataPtr, GifFileData& gif, const uint8*& outSubBlocks)
+    {
+        Frame nextFrame = {0};
+        uint32& frameIdx = gif.numFrames;
+        
+        dataPtr = parseFrameHeader(dataPtr, nextFrame, gif.pixelFormat);
+        nextFrame.lzwMinCodeSize = *dataPtr++;
+        GT_CHECK(nextFrame.lzwMinCodeSize <= MAX_LZW_MIN_CODE_SIZE, "Error getting LZWMinCodeSize: value should always be <=11, but current value is %i", nextFrame.lzwMinCodeSize);
+        
+        outSubBlocks = dataPtr;
+        uint8 sizeOfSubBlock = *dataPtr;
+        if (sizeOfSubBlock > 0) dataPtr++;
+        while(sizeOfSubBlock > 0)
+        {
+            dataPtr += sizeOfSubBlock;
+            sizeOfSubBlock = *dataPtr;
+            if (sizeOfSubBlock > 0) dataPtr++;
+        }
+        
+        gif.imageData[frameIdx] = nextFrame;
+        
+        GT_CHECK(*dataPtr == 0x0, "Last byte of frame isn't block terminator. Something has gone wrong");
+        
+        dataPtr++;
+        frameIdx++;
+        return dataPtr;
+    }
+    
+    const uint8* parseFrameDeferred(const uint8* dataPtr, GifFileData& gif, PendingFrame* outPending)
+    {
+        PendingFrame& pending = outPending[gif.numFrames];
+        pending.transparentIdx = transparentIdxForFrame(gif, gif.numFrames);
+        pending.clearCanvas = frameClearsCanvas(gif);
+        return parseFrameSkipData(dataPtr, gif, pending.subBlocks);
+    }
+    
+    //LZW decompression is the expensive part of decoding a frame, and unlike compositing it doesn't depend on
+    //the frames before it. Every thread (including the calling one) decompresses frames into a ring of index
+    //streams a few frames ahead of the oldest one that hasn't been composited yet, and the calling thread
+    //composites them in order as they finish. Keeping the ring small bounds memory no matter how many frames
+    //the gif has
+    void decodeFramesInParallel(GifFileData& gif, const PendingFrame* pendingFrames, uint8* frameBuffer, uint8** outImages, IndexedCanvas* indexed, uint32 numThreads)
+    {
+        if (gif.numFrames == 0) return;
+        if (numThreads > gif.numFrames) numThreads = gif.numFrames;
+        
+        const uint32 numSlots = numThreads * 2;
+        IndexStream* slots = (IndexStream*)GT_CALLOC(numSlots, sizeof(IndexStream));
+        bool* decoded = (bool*)GT_CALLOC(gif.numFrames, sizeof(bool));
+        
+        std::mutex lock;
+        std::condition_variable frameDecoded;
+        std::condition_variable slotFreed;
+        uint32 nextFrame = 0;
+        uint32 numComposited = 0;
+        
+        //must be called with lock held, and returns with it held
+        auto decodeNextFrame = [&](std::unique_lock<std::mutex>& held)
+        {
+            uint32 frameIdx = nextFrame++;
+            held.unlock();
+            decompressFrameIndices(pendingFrames[frameIdx].subBlocks, gif.imageData[frameIdx], gif, slots[frameIdx % numSlots]);
+            held.lock();
+            decoded[frameIdx] = true;
+            frameDecoded.notify_all();
+        };
+        
+        auto canStartFrame = [&]()
+        {
+            return nextFrame < gif.numFrames && nextFrame < numComposited + numSlots;
+        };
+        
+        std::thread* workers = new std::thread[numThreads - 1];
+        for (uint32 i = 0; i < numThreads - 1; ++i)
+        {
+            workers[i] = std::thread([&]()
+            {
+                std::unique_lock<std::mutex> held(lock);
+                while (nextFrame < gif.numFrames)
+                {
+                    if (canStartFrame()) decodeNextFrame(held);
+                    else slotFreed.wait(held);
+                }
+            });
+        }
+        
+        for (uint32 frameIdx = 0; frameIdx < gif.numFrames; ++frameIdx)
+        {
+            {
+                //help with decompression rather than sit idle while this frame isn't ready yet
+                std::unique_lock<std::mutex> held(lock);
+                while (!decoded[frameIdx])
+                {
+                    if (canStartFrame()) decodeNextFrame(held);
+                    else frameDecoded.wait(held);
+                }
+            }
+            
+            const PendingFrame& pending = pendingFrames[frameIdx];
+            FrameTarget target;
+            setupFrameTarget(target, frameBuffer, gif, gif.imageData[frameIdx], frameIdx);
+            target.transparentIdx = pending.transparentIdx;
+            
+            IndexStream& indexStream = slots[frameIdx % numSlots];
+            if (indexed && !beginIndexedFrame(*indexed, target, gif, pending.clearCanvas, frameIdx))
+            {
+                compositeMergedFrame(*indexed, target, gif, indexStream, frameIdx);
+            }
+            else
+            {
+                if (pending.clearCanvas && !indexed) filBufferWithBackgroundColor(frameBuffer, gif);
+                compositeCompletedRows(indexStream, target);
+                compositePartialRow(indexStream, target);
+            }
+            copyOutFrame(frameBuffer, gif, outImages, frameIdx, indexed);
+            
+            {
+                std::lock_guard<std::mutex> held(lock);
+                numComposited++;
+            }
+            slotFreed.notify_all();
+        }
+        
+        for (uint32 i = 0; i < numThreads - 1; ++i)
+        {
+            workers[i].join();
+        }
+        delete[] workers;
+        
+        for (uint32 i = 0; i < numSlots; ++i)
+        {
+            GT_FREE(slots[i].indices);
+        }
+        GT_FREE(slots);
+        GT_FREE(decoded);
+    }
+}
+
+#pragma mark - GIF class methods
+namespace gif_read
+{
+    struct GIFImpl
+    {
+        GifFileData file;
+        uint8** images;
+        IndexedCanvas* indexed; //only with storeIndices
+    };
+    
+    void loadGIF(GIFImpl* impl, const uint8* gifData, const DecodeOptions& options)
+    {
+        GifFileData& gif = impl->file;
+        gif.numFrames = 0;
+        gif.decoder = options.decoder;
+        
+        const uint8* ptr = nullptr;
+        ptr = parseHeader(gifData, gif.header);
+        setupCanvas(gif, options);
+        ptr = parseGlobalColorTable(ptr, &gif.globalPalette, gif.header, gif.pixelFormat);
+        
+        uint32 frameCapacity = allocateFrameStorage(gif, ptr);
+        impl->images = (uint8**)GT_CALLOC(frameCapacity, sizeof(uint8*));
+        
+        uint32 numThreads = options.numThreads > 0 ? options.numThreads : std::thread::hardware_concurrency();
+        
+        //with more than one thread, frames are only located while parsing, and decoded once all of them are known
+        PendingFrame* pendingFrames = nullptr;
+        if (numThreads > 1)
+        {
+            pendingFrames = (PendingFrame*)GT_MALLOC(sizeof(PendingFrame) * frameCapacity);
+        }
+        
+        //working buffers for frame data
+        if (options.storeIndices) gif.bytesPerPixel = 1;
+        uint8* frameBuffer = (uint8*)GT_MALLOC(gif.canvasWidth * gif.canvasHeight * gif.bytesPerPixel * sizeof(uint8));
+        IndexStream indexStream;
+        
+        if (options.storeIndices)
+        {
+            impl->indexed = (IndexedCanvas*)GT_CALLOC(1, sizeof(IndexedCanvas));
+            initIndexedCanvas(*impl->indexed, frameBuffer, gif, frameCapacity);
+        }
+        else
+        {
+            //the canvas starts as the background, so the first frame's transparent pixels have something defined under them
+            filBufferWithBackgroundColor(frameBuffer, gif);
+        }
+        
+        uint8 nextBlock = *ptr++;
+        while (nextBlock != BT_Trailer)
+        {
+            if (nextBlock == BT_Extension)
+            {
+                ptr = parseExtension(ptr, gif.totalRunTime, gif.gfxControlBlocks, gif.numGfxBlocks);
+            }
+            else if (nextBlock == BT_ImageDescriptor)
+            {
+                if (pendingFrames) ptr = parseFrameDeferred(ptr, gif, pendingFrames);
+                else ptr = parseFrame(ptr, frameBuffer, gif, impl->images, indexStream, impl->indexed);
+            }
+            else
+            {
+                GT_CHECK(false, "Got bad block format byte. Code expects each block to start with either 0x21, 0x2C or 0x3B");
+            }
+            
+            nextBlock = *ptr++;
+        }
+        
+        if (pendingFrames)
+        {
+            decodeFramesInParallel(gif, pendingFrames, frameBuffer, impl->images, impl->indexed, numThreads);
+            GT_FREE(pendingFrames);
+        }
+        
+        GT_FREE(frameBuffer);
+        GT_FREE(indexStream.indices);
+        if (impl->indexed)
+        {
+            GT_FREE(impl->indexed->coverage);
+            GT_FREE(impl->indexed->frameLayer);
+            GT_FREE(impl->indexed->colorCanvas);
+        }
+        
+        for (uint32 i = 0; i < gif.numFrames; ++i)
+        {
+            if (gif.imageData[i].localPalette) GT_FREE(gif.imageData[i].localPalette);
+        }
+    }
+    
+    GIF::GIF( const uint8* gifData, const DecodeOptions& options /* = DecodeOptions() */ )
+    {
+        _impl = (GIFImpl*)GT_CALLOC(1,sizeof(GIFImpl));
+        loadGIF(_impl, gifData, options);
+    }
+    
+    GIF::GIF( const uint8* gifData, uint32 fileSize, ParseResult& outResult, const DecodeOptions& options /* = DecodeOptions() */ )
+    {
+        _impl = (GIFImpl*)GT_CALLOC(1,sizeof(GIFImpl));
+        outResult = validateGifData(gifData, fileSize);
+        if (outResult == PR_Ok) loadGIF(_impl, gifData, options);
+    }
+    
+    //true for every frame unless the gif stores indices, in which case it's only frames with too many colors
+    bool frameStoredInColor(const GIFImpl& impl, uint32 frameIdx)
+    {
+        return !impl.indexed || impl.indexed->framePaletteIds[frameIdx] == NO_PALETTE;
+    }
+    
+    const uint8* GIF::getFrame(uint32 frameIndex) const
+    {
+        GT_CHECK(frameIndex < _impl->file.numFrames, "Out-of-bounds error when trying to get Gif frame");
+        if (frameIndex >= _impl->file.numFrames || !frameStoredInColor(*_impl, frameIndex)) return nullptr;
+        return _impl->images[frameIndex];
+    }
+    
+    const uint8* GIF::getFrameAtTime(float time, bool looping) const
+    {
+        GT_CHECK(time >= 0, "Attempting to get a gif frame at a negative time (%f)", time);
+        GifFileData& gif = _impl->file;
+        if (gif.numFrames == 0) return nullptr; //images is null if the gif failed to load
+        
+        uint32 frameIdx = gif.numFrames - 1;
+        if (gif.totalRunTime == 0)
+        {
+            frameIdx = 0;
+        }
+        else
+        {
+            uint32 runningTime = 0;
+            uint32 hundredths = looping ? (uint32)(time * 100) % gif.totalRunTime : (time) * 100;
+            
+            for (uint32 i = 0; i < gif.numGfxBlocks && i < gif.numFrames; ++i)
+            {
+                runningTime += gif.gfxControlBlocks[i].delayTime;
+                if (hundredths <= runningTime)
+                {
+                    frameIdx = i;
+                    break;
+                }
+            }
+        }
+        
+        return frameStoredInColor(*_impl, frameIdx) ? _impl->images[frameIdx] : nullptr;
+    }
+    
+    const uint8* GIF::getFrameIndices(uint32 frameIndex) const
+    {
+        GT_CHECK(frameIndex < _impl->file.numFrames, "Out-of-bounds error when trying to get Gif frame");
+        if (frameIndex >= _impl->file.numFrames || frameStoredInColor(*_impl, frameIndex)) return nullptr;
+        return _impl->images[frameIndex];
+    }
+    
+    uint32 GIF::getFramePaletteId(uint32 frameIndex) const
+    {
+        GT_CHECK(frameIndex < _impl->file.numFrames, "Out-of-bounds error when trying to get Gif frame");
+        if (!_impl->indexed || frameIndex >= _impl->file.numFrames) return 0;
+        return _impl->indexed->framePaletteIds[frameIndex];
+    }
+    
+    uint32 GIF::getNumPalettes() const
+    {
+        return _impl->indexed ? _impl->indexed->numPalettes : 0;
+    }
+    
+    const uint8* GIF::getPalette(uint32 paletteId) const
+    {
+        GT_CHECK(_impl->indexed && paletteId < _impl->indexed->numPalettes, "Out-of-bounds error when trying to get Gif palette");
+        if (!_impl->indexed || paletteId >= _impl->indexed->numPalettes) return nullptr;
+        return (const uint8*)_impl->indexed->palettes[paletteId];
+    }
+    
+    void GIF::getFrameRGBA(uint32 frameIndex, uint8* outRGBA) const
+    {
+        GT_CHECK(frameIndex < _impl->file.numFrames, "Out-of-bounds error when trying to get Gif frame");
+        const GifFileData& gif = _impl->file;
+        if (frameIndex >= gif.numFrames) return;
+        uint32 numPixels = gif.canvasWidth * gif.canvasHeight;
+        
+        //an indexed gif's canvas is 1 byte per pixel, but its frames come out in its pixelFormat either way
+        uint32 bytesPerPixel = bytesPerPixelForFormat(gif.pixelFormat);
+        if (frameStoredInColor(*_impl, frameIndex))
+        {
+            memcpy(outRGBA, _impl->images[frameIndex], numPixels * bytesPerPixel);
+        }
+        else
+        {
+            const uint32* palette = _impl->indexed->palettes[_impl->indexed->framePaletteIds[frameIndex]];
+            expandRowToFormat(outRGBA, _impl->images[frameIndex], numPixels, palette, NO_CODE, bytesPerPixel);
+        }
+    }
+    
+    uint32 GIF::getWidth() const
+    {
+        return _impl->file.canvasWidth;
+    }
+    
+    uint32 GIF::getHeight() const
+    {
+        return _impl->file.canvasHeight;
+    }
+    
+    uint32 GIF::getNumFrames() const
+    {
+        return _impl->file.numFrames;
+    }
+    
+    GIF::~GIF()
+    {
+        if (_impl)
+        {
+            GT_FREE(_impl->file.globalPalette);
+            for (uint32 i = 0; i < _impl->file.numFrames; ++i) GT_FREE(_impl->images[i]);
+            GT_FREE(_impl->images);
+            GT_FREE(_impl->file.imageData);
+            GT_FREE(_impl->file.gfxControlBlocks);
+            
+            if (_impl->indexed)
+            {
+                for (uint32 i = 0; i < _impl->indexed->numPalettes; ++i) GT_FREE(_impl->indexed->palettes[i]);
+                GT_FREE(_impl->indexed->palettes);
+                GT_FREE(_impl->indexed->framePaletteIds);
+                GT_FREE(_impl->indexed);
+            }
+            GT_FREE(_impl);
+        }
+    }
+}
+
+#pragma mark - IStreamingGIF class methods
+namespace gif_read
+{
+    //a decoded frame, shared by every player showing exactly these pixels. Players in lockstep end up on
+    //the same SharedFrame, so each frame only gets decoded once for all of them
+    struct SharedFrame
+    {
+        uint8* pixels;
+        uint32 refCount;
+        uint32 version; //changes whenever pixels are overwritten, which breaks any links to this frame
+        
+        //the frame most recently decoded on top of this one. Players going from this frame to nextFrameIdx
+        //share it instead of decoding their own copy, as long as it's still at nextVersion
+        SharedFrame* next;
+        uint32 nextVersion;
+        uint32 nextFrameIdx;
+        bool pending; //still being decoded by a StreamingGIF::tick() batch, so only that batch can share it yet
+        
+        SharedFrame* nextFree;
+        SharedFrame* nextAllocated;
+    };
+    
+    //everything a GifAsset holds. Only frameLock's members change once the asset has loaded
+    struct GifAssetImpl
+    {
+        GifFileData file;
+        uint8* firstFrame = nullptr;
+        
+        uint32 indexStreamSize = 0; //big enough to decode any frame, for sizing each player's index stream
+        uint8** compressedData = nullptr; //streaming compressed gif pre-concatenates compressed data for each frame
+        uint32* compressedDataSizes = nullptr;
+        
+        //when referencing the caller's file data, frames are decompressed straight out of their sub blocks
+        //in it instead, and compressedData is never allocated
+        const uint8* fileData = nullptr;
+        uint32* subBlockOffsets = nullptr;
+        
+        SharedFrame* firstShared; //wraps firstFrame, and is never released
+        SharedFrame* freeFrames;
+        SharedFrame* allFrames;
+        uint32 refCount;
+        std::mutex* frameLock; //guards refCount, and SharedFrame ref counts, links and lists
+    };
+    
+    //playback state of a GifPlayer, or of one StreamingGIF iterator
+    struct PlayerState
+    {
+        GifAsset* owner;
+        GifAssetImpl* asset;
+        
+        float currentTime = 0.0f;
+        uint32 currentFrameIdx = 0;
+        SharedFrame* frame = nullptr; //null once the player has been destroyed
+        
+        //each player decodes with its own scratch space, so different players can be ticked on different
+        //threads at the same time
+        IndexStream indexStream;
+    };
+    
+    //a frame that has to be decoded for a player, over a copy of from, or in place if from is null
+    struct TickJob
+    {
+        PlayerState* player;
+        uint32 frameIdx;
+        SharedFrame* from;
+        SharedFrame* to;
+    };
+    
+    //iterator handles are a slot index in the low bits and that slot's generation in the high bits. A slot's
+    //generation goes up every time its iterator is destroyed, so old handles to a reused slot stop being valid
+    const uint32 ITERATOR_SLOT_BITS = 16;
+    const uint32 ITERATOR_SLOT_MASK = (1 << ITERATOR_SLOT_BITS) - 1;
+    const uint32 ITERATOR_GENERATION_MASK = (1 << (32 - ITERATOR_SLOT_BITS)) - 1;
+    const uint32 MAX_ITERATORS = ITERATOR_SLOT_MASK; //the last slot is never used, so NO_SLOT is never a valid handle
+    const uint32 NO_SLOT = 0xFFFFFFFF;
+    
+    struct IteratorSlot
+    {
+        uint32 generation;
+        uint32 nextFree; //NO_SLOT at the end of the free list
+    };
+    
+    struct StreamingGIFImpl
+    {
+        GifAsset* asset;
+        
+        //a slot map. Slots below numIterators have been used at some point, destroyed ones are in a list
+        //starting at firstFreeSlot (and have a null frame), and capacity doubles when every slot is live
+        PlayerState* iterators;
+        IteratorSlot* slots;
+        uint32 numIterators;
+        uint32 capacity;
+        uint32 firstFreeSlot;
+        
+        //one of each per iterator, so tick() never has to allocate
+        TickJob* tickJobs;
+        SharedFrame** tickReleases;
+    };
+    
+    //decompresses frame frameIdx into target, from wherever the asset keeps its compressed data. Only reads
+    //from asset, every bit of decoder state lives on the stack or in indexStream
+    void decompressStreamingFrame(const GifAssetImpl& asset, uint32 frameIdx, FrameTarget& target, IndexStream& indexStream)
+    {
+        const GifFileData& gif = asset.file;
+        const Frame& frameData = gif.imageData[frameIdx];
+        LZWTables tables;
+        tables.decoder = gif.decoder;
+        InitializeTables(tables, frameData.imageDesc.localColorTableFlag ? frameData.imageDesc.colorTableSize : gif.header.screenDescriptor.colorTableSize, frameData.lzwMinCodeSize);
+        
+        indexStream.numIndices = 0;
+        
+        if (asset.fileData)
+        {
+            decompressSubBlocks(asset.fileData + asset.subBlockOffsets[frameIdx], frameData.lzwMinCodeSize, tables, DecompressionState(), indexStream, &target);
+        }
+        else
+        {
+            DecompressionState dcState;
+            decompressToFrame(asset.compressedData[frameIdx], asset.compressedDataSizes[frameIdx], frameData.lzwMinCodeSize, tables, dcState, indexStream, &target);
+        }
+        compositePartialRow(indexStream, target);
+    }
+    
+    //the frame that should be on screen at time seconds into the gif, or numFrames if there isn't one
+    uint32 frameAtTime(const GifFileData& gif, float time)
+    {
+        if (gif.totalRunTime == 0) return gif.numFrames;
+        
+        uint32 runningTime = 0;
+        uint32 hundredths = (uint32)(time * 100.0f) % gif.totalRunTime;
+        
+        for (uint32 i = 0; i < gif.numGfxBlocks && i < gif.numFrames; ++i)
+        {
+            runningTime += gif.gfxControlBlocks[i].delayTime;
+            if (hundredths < runningTime) return i;
+        }
+        return gif.numFrames;
+    }
+    
+    //call with frameLock held
+    SharedFrame* acquireFrame(GifAssetImpl& asset)
+    {
+        SharedFrame* frame = asset.freeFrames;
+        if (frame)
+        {
+            asset.freeFrames = frame->nextFree;
+        }
+        else
+        {
+            const GifFileData& gif = asset.file;
+            frame = (SharedFrame*)GT_CALLOC(1, sizeof(SharedFrame));
+            frame->pixels = (uint8*)GT_MALLOC(gif.canvasWidth * gif.canvasHeight * gif.bytesPerPixel * sizeof(uint8));
+            frame->nextAllocated = asset.allFrames;
+            asset.allFrames = frame;
+        }
+        return frame;
+    }
+    
+    //call with frameLock held. Frames nobody is showing are kept for reuse rather than freed
+    void releaseFrame(GifAssetImpl& asset, SharedFrame* frame)
+    {
+        if (--frame->refCount > 0) return;
+        
+        frame->version++;
+        frame->next = nullptr;
+        frame->nextFree = asset.freeFrames;
+        asset.freeFrames = frame;
+    }
+    
+    //call with frameLock held, for a job that decoded over a copy of its frame
+    void linkFrame(const TickJob& job)
+    {
+        job.from->next = job.to;
+        job.from->nextVersion = job.to->version;
+        job.from->nextFrameIdx = job.frameIdx;
+    }
+    
+    //call with frameLock held. Moves player onto frameIdx by sharing a frame that's already been decoded from
+    //the same one it's on if there is one. Otherwise fills job with the decode it needs, either over its
+    //current frame (if no other player is showing it) or over a copy of it. Returns whether there's a job.
+    //The frame the player was on is returned in outReleased, to be released once no jobs need it anymore.
+    //batch is set when planning every job for a tick before running any of them, in which case new frames are
+    //linked straight away (and marked pending) so the rest of the batch can share them
+    bool planFrame(PlayerState& player, uint32 frameIdx, bool batch, TickJob& job, SharedFrame*& outReleased)
+    {
+        GifAssetImpl& asset = *player.asset;
+        SharedFrame* from = player.frame;
+        outReleased = nullptr;
+        player.currentFrameIdx = frameIdx;
+        
+        job.player = &player;
+        job.frameIdx = frameIdx;
+        job.from = nullptr;
+        job.to = from;
+        
+        SharedFrame* to = nullptr;
+        if (frameIdx == 0 && asset.firstShared)
+        {
+            to = asset.firstShared;
+        }
+        else if (from->next && from->next->version == from->nextVersion && from->nextFrameIdx == frameIdx && (batch || !from->next->pending))
+        {
+            to = from->next;
+        }
+        else if (from->refCount == 1 && from != asset.firstShared)
+        {
+            from->version++;
+            from->next = nullptr;
+            return true;
+        }
+        
+        bool decode = to == nullptr;
+        if (decode)
+        {
+            to = acquireFrame(asset);
+            job.from = from;
+            job.to = to;
+            
+            //until the link is made, nothing else can find the new frame. Outside a batch it's only linked once
+            //it's been decoded
+            if (batch)
+            {
+                linkFrame(job);
+                to->pending = true;
+            }
+        }
+        
+        to->refCount++;
+        player.frame = to;
+        outReleased = from;
+        return decode;
+    }
+    
+    //decodes a job's frame. Only writes to job.to and the player's scratch, so jobs for different players can
+    //run on different threads
+    void runFrameJob(const TickJob& job)
+    {
+        const GifAssetImpl& asset = *job.player->asset;
+        const GifFileData& gif = asset.file;
+        uint8* pixels = job.to->pixels;
+        
+        if (gif.gfxControlBlocks[job.frameIdx].disposal == DM_CLEAR_TO_BACKGROUND)
+        {
+            filBufferWithBackgroundColor(pixels, gif);
+        }
+        else if (job.from)
+        {
+            memcpy(pixels, job.from->pixels, gif.canvasWidth * gif.canvasHeight * gif.bytesPerPixel * sizeof(uint8));
+        }
+        
+        FrameTarget target;
+        setupFrameTarget(target, pixels, gif, gif.imageData[job.frameIdx], job.frameIdx);
+        decompressStreamingFrame(asset, job.frameIdx, target, job.player->indexStream);
+    }
+    
+    //job for TaskScheduler::run, with the StreamingGIFImpl as jobData
+    void tickJob(void* jobData, uint32 jobIndex)
+    {
+        StreamingGIFImpl& impl = *(StreamingGIFImpl*)jobData;
+        runFrameJob(impl.tickJobs[jobIndex]);
+    }
+    
+    //new players all start off sharing the first frame
+    void initPlayer(PlayerState& player, GifAsset* owner, GifAssetImpl* asset)
+    {
+        player.owner = owner;
+        player.asset = asset;
+        player.currentTime = 0;
+        player.currentFrameIdx = 0;
+        player.indexStream = IndexStream();
+        reserveIndexStream(player.indexStream, asset->indexStreamSize);
+        
+        std::lock_guard<std::mutex> held(*asset->frameLock);
+        asset->refCount++;
+        player.frame = asset->firstShared;
+        player.frame->refCount++;
+    }
+    
+    //returns true if time has advanced enough to get a new frame
+    bool tickPlayer(PlayerState& player, float deltaTime)
+    {
+        player.currentTime += deltaTime;
+        
+        uint32 frameIdx = frameAtTime(player.asset->file, player.currentTime);
+        if (frameIdx >= player.asset->file.numFrames) return false;
+        if (frameIdx == player.currentFrameIdx) return true;
+        
+        TickJob job;
+        SharedFrame* released;
+        bool decode;
+        {
+            std::lock_guard<std::mutex> held(*player.asset->frameLock);
+            decode = planFrame(player, frameIdx, false, job, released);
+        }
+        
+        if (decode) runFrameJob(job);
+        
+        if (released)
+        {
+            std::lock_guard<std::mutex> held(*player.asset->frameLock);
+            if (decode) linkFrame(job);
+            releaseFrame(*player.asset, released);
+        }
+        return true;
+    }
+    
+    //gives back the player's frame and its reference to the asset, which may destroy the asset
+    void destroyPlayer(PlayerState& player)
+    {
+        {
+            std::lock_guard<std::mutex> held(*player.asset->frameLock);
+            releaseFrame(*player.asset, player.frame);
+        }
+        GT_FREE(player.indexStream.indices);
+        player.indexStream = IndexStream();
+        player.frame = nullptr;
+        player.owner->release();
+    }
+    
+    //the live iterator a handle refers to, or null if it was never created or has been destroyed since
+    PlayerState* findIterator(const StreamingGIFImpl& impl, uint32 iterator)
+    {
+        uint32 slot = iterator & ITERATOR_SLOT_MASK;
+        if (slot >= impl.numIterators) return nullptr;
+        if (impl.slots[slot].generation != iterator >> ITERATOR_SLOT_BITS) return nullptr;
+        if (impl.iterators[slot].frame == nullptr) return nullptr;
+        return &impl.iterators[slot];
+    }
+    
+    //resizes every per iterator array to hold capacity iterators, zeroing the new slots
+    void reserveIterators(StreamingGIFImpl& impl, uint32 capacity)
+    {
+        impl.iterators = (PlayerState*)GT_REALLOC(impl.iterators, sizeof(PlayerState) * capacity);
+        impl.slots = (IteratorSlot*)GT_REALLOC(impl.slots, sizeof(IteratorSlot) * capacity);
+        impl.tickJobs = (TickJob*)GT_REALLOC(impl.tickJobs, sizeof(TickJob) * capacity);
+        impl.tickReleases = (SharedFrame**)GT_REALLOC(impl.tickReleases, sizeof(SharedFrame*) * capacity);
+        for (uint32 i = impl.capacity; i < capacity; ++i)
+        {
+            impl.iterators[i] = PlayerState();
+        }
+        memset(impl.slots + impl.capacity, 0, sizeof(IteratorSlot) * (capacity - impl.capacity));
+        impl.capacity = capacity;
+    }
+    
+    void initStreamingGIFImpl(StreamingGIFImpl& impl, uint32 maxIterators)
+    {
+        impl.firstFreeSlot = NO_SLOT;
+        maxIterators = maxIterators > 0 ? maxIterators : 1;
+        reserveIterators(impl, maxIterators < MAX_ITERATORS ? maxIterators : MAX_ITERATORS);
+    }
+    
+    const uint8* StreamingGIF::getCurrentFrame(uint32 iterator) const
+    {
+        PlayerState* iter = findIterator(*_impl, iterator);
+        GT_CHECK(iter, "Attempting to get frame for an iterator that does not exist");
+        
+        return iter->frame->pixels;
+    }
+    
+    const uint8* StreamingGIF::getFirstFrame() const
+    {
+        return _impl->asset->getFirstFrame();
+    }
+    
+    GifAsset* StreamingGIF::getAsset() const
+    {
+        return _impl->asset;
+    }
+    
+    uint32 StreamingGIF::getWidth() const
+    {
+        return _impl->asset->getWidth();
+    }
+    
+    uint32 StreamingGIF::getHeight() const
+    {
+        return _impl->asset->getHeight();
+    }
+    
+    uint32 StreamingGIF::getNumFrames() const
+    {
+        return _impl->asset->getNumFrames();
+    }
+    
+    float StreamingGIF::getDurationInSeconds() const
+    {
+        return _impl->asset->getDurationInSeconds();
+    }
+}
+
+#pragma mark - GifAsset and GifPlayer class methods
+namespace gif_read
+{
+    //players start on firstShared. For a gif that failed to load, firstFrame is null and so is every
+    //player's frame
+    void shareFirstFrame(GifAssetImpl* impl)
+    {
+        impl->firstShared = (SharedFrame*)GT_CALLOC(1, sizeof(SharedFrame));
+        impl->firstShared->pixels = impl->firstFrame;
+        impl->firstShared->refCount = 1;
+    }
+    
+    void loadGifAsset(GifAssetImpl* impl, const uint8* gifData, const DecodeOptions& options)
+    {
+        GifFileData& gif = impl->file;
+        gif.numFrames = 0;
+        gif.decoder = options.decoder;
+        
+        const uint8* ptr = nullptr;
+        ptr = parseHeader(gifData, gif.header);
+        setupCanvas(gif, options);
+        ptr = parseGlobalColorTable(ptr, &gif.globalPalette, gif.header, gif.pixelFormat);
+        
+        uint32 frameCapacity = allocateFrameStorage(gif, ptr);
+        if (options.referenceFileData)
+        {
+            impl->fileData = gifData;
+            impl->subBlockOffsets = (uint32*)GT_CALLOC(frameCapacity, sizeof(uint32));
+        }
+        else
+        {
+            impl->compressedData = (uint8**)GT_CALLOC(frameCapacity, sizeof(uint8*));
+            impl->compressedDataSizes = (uint32*)GT_CALLOC(frameCapacity, sizeof(uint32));
+        }
+        
+        //working buffer for frame data. Starts as the background, so the first frame's transparent pixels have
+        //something defined under them
+        impl->firstFrame = (uint8*)GT_MALLOC(gif.canvasWidth * gif.canvasHeight * gif.bytesPerPixel * sizeof(uint8));
+        filBufferWithBackgroundColor(impl->firstFrame, gif);
+        
+        uint8 nextBlock = *ptr++;
+        while (nextBlock != BT_Trailer)
+        {
+            if (nextBlock == BT_Extension)
+            {
+                ptr = parseExtension(ptr, gif.totalRunTime, gif.gfxControlBlocks, gif.numGfxBlocks);
+            }
+            else if (nextBlock == BT_ImageDescriptor)
+            {
+                if (impl->fileData)
+                {
+                    const uint8* subBlocks = nullptr;
+                    ptr = parseFrameSkipData(ptr, gif, subBlocks);
+                    impl->subBlockOffsets[gif.numFrames-1] = (uint32)(subBlocks - gifData);
+                }
+                else
+                {
+                    ptr = parseFrameNoDecompress(ptr, gif, impl->compressedData, impl->compressedDataSizes);
+                }
+            }
+            else
+            {
+                GT_CHECK(false, "Got bad block format byte. Code expects each block to start with either 0x21, 0x2C or 0x3B");
+            }
+            
+            nextBlock = *ptr++;
+        }
+        
+        
+        //players get index streams sized for the largest frame up front, so ticking never needs to allocate
+        for (uint32 i = 0; i < gif.numFrames; ++i)
+        {
+            uint32 size = indexStreamSizeForFrame(gif.imageData[i], gif.decoder);
+            if (size > impl->indexStreamSize) impl->indexStreamSize = size;
+        }
+        
+        if (gif.numFrames > 0)
+        {
+            IndexStream indexStream;
+            reserveIndexStream(indexStream, indexStreamSizeForFrame(gif.imageData[0], gif.decoder));
+            
+            FrameTarget target;
+            setupFrameTarget(target, impl->firstFrame, gif, gif.imageData[0], 0);
+            decompressStreamingFrame(*impl, 0, target, indexStream);
+            GT_FREE(indexStream.indices);
+        }
+        
+        shareFirstFrame(impl);
+    }
+    
+    GifAsset* GifAsset::create( const uint8* gifData, const DecodeOptions& options /* = DecodeOptions() */ )
+    {
+        GifAsset* asset = new GifAsset();
+        asset->_impl = (GifAssetImpl*)GT_CALLOC(1, sizeof(GifAssetImpl));
+        asset->_impl->refCount = 1;
+        asset->_impl->frameLock = new std::mutex;
+        loadGifAsset(asset->_impl, gifData, options);
+        return asset;
+    }
+    
+    GifAsset* GifAsset::create( const uint8* gifData, uint32 fileSize, ParseResult& outResult, const DecodeOptions& options /* = DecodeOptions() */ )
+    {
+        GifAsset* asset = new GifAsset();
+        asset->_impl = (GifAssetImpl*)GT_CALLOC(1, sizeof(GifAssetImpl));
+        asset->_impl->refCount = 1;
+        asset->_impl->frameLock = new std::mutex;
+        
+        outResult = validateGifData(gifData, fileSize);
+        if (outResult == PR_Ok) loadGifAsset(asset->_impl, gifData, options);
+        else shareFirstFrame(asset->_impl);
+        return asset;
+    }
+    
+    void GifAsset::retain()
+    {
+        std::lock_guard<std::mutex> held(*_impl->frameLock);
+        _impl->refCount++;
+    }
+    
+    void GifAsset::release()
+    {
+        {
+            std::lock_guard<std::mutex> held(*_impl->frameLock);
+            GT_CHECK(_impl->refCount > 0, "Releasing a GifAsset that has already been destroyed");
+            if (--_impl->refCount > 0) return;
+        }
+        delete this;
+    }
+    
+    GifAsset::~GifAsset()
+    {
+        if (_impl->compressedData)
+        {
+            for (uint32 i = 0; i < _impl->file.numFrames; ++i)
+            {
+                GT_FREE(_impl->compressedData[i]);
+            }
+        }
+        GT_FREE(_impl->compressedData);
+        GT_FREE(_impl->compressedDataSizes);
+        GT_FREE(_impl->subBlockOffsets);
+        
+        GT_FREE(_impl->file.globalPalette);
+        for (uint32 i = 0; i < _impl->file.numFrames; ++i)
+        {
+            if (_impl->file.imageData[i].localPalette) GT_FREE(_impl->file.imageData[i].localPalette);
+        }
+        GT_FREE(_impl->file.imageData);
+        GT_FREE(_impl->file.gfxControlBlocks);
+        
+        SharedFrame* frame = _impl->allFrames;
+        while (frame)
+        {
+            SharedFrame* nextFrame = frame->nextAllocated;
+            GT_FREE(frame->pixels);
+            GT_FREE(frame);
+            frame = nextFrame;
+        }
+        GT_FREE(_impl->firstShared);
+        GT_FREE(_impl->firstFrame);
+        delete _impl->frameLock;
+        
+        GT_FREE(_impl);
     }
     
-    uint32 GIF::getNumFrames() const
+    uint32 GifAsset::getWidth() const
     {
-        return _impl->file.numFrames;
+        return _impl->file.canvasWidth;
     }
     
-    GIF::~GIF()
+    uint32 GifAsset::getHeight() const
     {
-        if (_impl)
-        {
-            GT_FREE(_impl->file.globalColorTable);
-            for (uint32 i = 0; i < _impl->file.numFrames; ++i) GT_FREE(_impl->images[i]);
-            GT_FREE(_impl);
-        }
+        return _impl->file.canvasHeight;
     }
-}
-
-#pragma mark - IStreamingGIF class methods
-namespace gif_read
-{
-    struct StreamingGIFIter
-    {
-        float currentTime = 0.0f;
-        uint16 currentFrameIdx = 0;
-        uint8* currentFrame = nullptr;
-    };
     
-    struct StreamingGIFImpl
+    uint32 GifAsset::getNumFrames() const
     {
-        GifFileData file;
-        uint8* firstFrame = nullptr;
-        
-        IndexStream* indexStreams = nullptr; //streaming gif pre-calculates the index stream for each frame
-        uint8** compressedData = nullptr; //streaming compressed gif pre-concatenates compressed data for each frame
-        uint16* compressedDataSizes = nullptr;
-        DecompressionState decompressionState;
-        
-        StreamingGIFIter* iterators;
-        uint32 numIterators;
-        uint32 maxIterators;
-    };
+        return _impl->file.numFrames;
+    }
     
-    const uint8* StreamingGIF::getCurrentFrame(uint32 iterator) const
+    float GifAsset::getDurationInSeconds() const
     {
-        GT_CHECK(iterator < _impl->maxIterators, "Attempting to get frame for iterator that does not exist");
-        GT_CHECK(iterator < _impl->numIterators, "Attempting to get frame for an iterator that does not exist");
-        
-        StreamingGIFIter& iter = _impl->iterators[iterator];
-        if (iter.currentFrameIdx == 0) return _impl->firstFrame;
-        return _impl->iterators[iterator].currentFrame;
+        return _impl->file.totalRunTime / 100.0f;
     }
     
-    const uint8* StreamingGIF::getFirstFrame() const
+    const uint8* GifAsset::getFirstFrame() const
     {
         return _impl->firstFrame;
     }
     
-    uint32 StreamingGIF::getWidth() const
+    GifPlayer::GifPlayer( GifAsset* asset )
     {
-        return _impl->file.header.width;
+        _impl = (PlayerState*)GT_CALLOC(1, sizeof(PlayerState));
+        initPlayer(*_impl, asset, asset->_impl);
     }
     
-    uint32 StreamingGIF::getHeight() const
+    GifPlayer::~GifPlayer()
     {
-        return _impl->file.header.height;
+        destroyPlayer(*_impl);
+        GT_FREE(_impl);
     }
     
-    uint32 StreamingGIF::getNumFrames() const
+    bool GifPlayer::tick(float deltaTime)
     {
-        return _impl->file.numFrames;
+        return tickPlayer(*_impl, deltaTime);
     }
     
-    float StreamingGIF::getDurationInSeconds() const
+    const uint8* GifPlayer::getCurrentFrame() const
+    {
+        return _impl->frame->pixels;
+    }
+    
+    uint32 GifPlayer::getCurrentFrameIndex() const
+    {
+        return _impl->currentFrameIdx;
+    }
+    
+    GifAsset* GifPlayer::getAsset() const
     {
-        return _impl->file.totalRunTime * 100;
+        return _impl->owner;
     }
 }
 
 #pragma mark - StreamingGIF class methods
 namespace gif_read
 {
-    StreamingGIF::StreamingGIF( const uint8* gifData, uint32 inMaxIterators /* = 8 */ )
+    StreamingGIF::StreamingGIF( const uint8* gifData, uint32 inMaxIterators /* = 8 */, const DecodeOptions& options /* = DecodeOptions() */ )
+    {
+        _impl = (StreamingGIFImpl*)GT_CALLOC(1,sizeof(StreamingGIFImpl));
+        initStreamingGIFImpl(*_impl, inMaxIterators);
+        _impl->asset = GifAsset::create(gifData, options);
+    }
+    
+    StreamingGIF::StreamingGIF( const uint8* gifData, uint32 fileSize, ParseResult& outResult, uint32 inMaxIterators /* = 8 */, const DecodeOptions& options /* = DecodeOptions() */ )
     {
         _impl = (StreamingGIFImpl*)GT_CALLOC(1,sizeof(StreamingGIFImpl));
-        _impl->iterators = (StreamingGIFIter*)GT_MALLOC(sizeof(StreamingGIFIter) * inMaxIterators);
-        _impl->maxIterators = inMaxIterators;
+        initStreamingGIFImpl(*_impl, inMaxIterators);
+        _impl->asset = GifAsset::create(gifData, fileSize, outResult, options);
+    }
+    
+    bool StreamingGIF::tickSingleIterator(uint32 iterator, float deltaTime)
+    {
+        PlayerState* iter = findIterator(*_impl, iterator);
+        if (!iter) return false;
+        return tickPlayer(*iter, deltaTime);
+    }
+    
+    //will only ever increment the current frame by 1. If you provide a
+    //timestep that requires jumping multiple frames, it will take several
+    //calls to tick() to catch up. This is intentional, to prevent CPU hitches
+    //from causing atypical CPU usage when encountering a hitch in a
+    //running game
+    void StreamingGIF::tick(float deltaTime)
+    {
+        GT_CHECK(deltaTime > 0, "Passed negative time to StreamingGif::Tick()");
+        deltaTime = deltaTime > 0 ? deltaTime : 0;
         
-        GifFileData& gif = _impl->file;
-        gif.numFrames = 0;
+        if (_impl->asset->_impl->file.totalRunTime == 0) return;
         
-        const uint8* ptr = nullptr;
-        ptr = parseHeader(gifData, gif.header);
-        ptr = parseGlobalColorTable(ptr, &gif.globalColorTable, gif.header);
+        for (uint32 i = 0; i < _impl->numIterators; ++i)
+        {
+            if (_impl->iterators[i].frame) tickPlayer(_impl->iterators[i], deltaTime);
+        }
+    }
+    
+    //working out which frame each iterator is on is cheap, so that's done here on the calling thread. Only
+    //iterators that need a frame decoded become jobs for the scheduler, and iterators moving in lockstep share
+    //one job
+    void StreamingGIF::tick(float deltaTime, TaskScheduler& scheduler)
+    {
+        GT_CHECK(deltaTime > 0, "Passed negative time to StreamingGif::Tick()");
+        deltaTime = deltaTime > 0 ? deltaTime : 0;
         
-        //working buffer for frame data
-        _impl->firstFrame = (uint8*)GT_MALLOC(gif.header.width * gif.header.height * 4 * sizeof(uint8));
-        _impl->compressedData = (uint8**)GT_MALLOC(sizeof(uint8**)*MAX_GIF_FRAMES);
-        _impl->compressedDataSizes = (uint16*)GT_MALLOC(sizeof(uint16) * MAX_GIF_FRAMES);
+        GifAssetImpl& asset = *_impl->asset->_impl;
+        const GifFileData& gif = asset.file;
+        if (gif.totalRunTime == 0) return;
         
-        uint8 nextBlock = *ptr++;
-        while (nextBlock != BT_Trailer)
+        //frames iterators are leaving are only released once every job has run, so none of them get decoded
+        //over while another job is still copying from them
+        uint32 numJobs = 0;
+        uint32 numReleases = 0;
         {
-            if (nextBlock == BT_Extension)
+            std::lock_guard<std::mutex> held(*asset.frameLock);
+            for (uint32 i = 0; i < _impl->numIterators; ++i)
             {
-                ptr = parseExtension(ptr, gif.totalRunTime, gif.gfxControlBlocks, gif.numGfxBlocks);
+                PlayerState& iter = _impl->iterators[i];
+                if (!iter.frame) continue;
+                
+                iter.currentTime += deltaTime;
+                
+                uint32 frameIdx = frameAtTime(gif, iter.currentTime);
+                if (frameIdx >= gif.numFrames || frameIdx == iter.currentFrameIdx) continue;
+                
+                SharedFrame* released;
+                if (planFrame(iter, frameIdx, true, _impl->tickJobs[numJobs], released)) numJobs++;
+                if (released) _impl->tickReleases[numReleases++] = released;
             }
-            else if (nextBlock == BT_ImageDescriptor)
+        }
+        
+        //the lock isn't held while decoding, so GifPlayers sharing the asset can keep ticking on other threads
+        if (numJobs == 1) tickJob(_impl, 0);
+        else if (numJobs > 1) scheduler.run(tickJob, _impl, numJobs);
+        
+        std::lock_guard<std::mutex> held(*asset.frameLock);
+        for (uint32 i = 0; i < numJobs; ++i)
+        {
+            _impl->tickJobs[i].to->pending = false;
+        }
+        for (uint32 i = 0; i < numReleases; ++i)
+        {
+            releaseFrame(asset, _impl->tickReleases[i]);
+        }
+    }
+    
+    bool StreamingGIF::isIteratorValid(uint32 iterator)
+    {
+        return findIterator(*_impl, iterator) != nullptr;
+    }
+    
+    //reuses the most recently destroyed slot if there is one, otherwise takes the next unused slot, growing
+    //the iterator arrays if there aren't any left
+    uint32 StreamingGIF::createIterator()
+    {
+        StreamingGIFImpl& impl = *_impl;
+        uint32 slot = impl.firstFreeSlot;
+        if (slot != NO_SLOT)
+        {
+            impl.firstFreeSlot = impl.slots[slot].nextFree;
+        }
+        else
+        {
+            GT_CHECK(impl.numIterators < MAX_ITERATORS, "Attempting to create more than %u live iterators", MAX_ITERATORS);
+            if (impl.numIterators == MAX_ITERATORS) return NO_SLOT;
+            if (impl.numIterators == impl.capacity)
             {
-                ptr = parseFrameNoDecompress(ptr, gif, _impl->compressedData, _impl->compressedDataSizes);
+                reserveIterators(impl, impl.capacity * 2 < MAX_ITERATORS ? impl.capacity * 2 : MAX_ITERATORS);
             }
-            else
+            slot = impl.numIterators++;
+        }
+        
+        initPlayer(impl.iterators[slot], impl.asset, impl.asset->_impl);
+        return (impl.slots[slot].generation << ITERATOR_SLOT_BITS) | slot;
+    }
+    
+    void StreamingGIF::destroyIterator(uint32 iterator)
+    {
+        StreamingGIFImpl& impl = *_impl;
+        PlayerState* iter = findIterator(impl, iterator);
+        if (!iter)
+        {
+            GT_CHECK(0, "Attemping to destroy an iterator that has not been created, or was already destroyed");
+            return;
+        }
+        
+        destroyPlayer(*iter);
+        
+        uint32 slot = iterator & ITERATOR_SLOT_MASK;
+        impl.slots[slot].generation = (impl.slots[slot].generation + 1) & ITERATOR_GENERATION_MASK;
+        impl.slots[slot].nextFree = impl.firstFreeSlot;
+        impl.firstFreeSlot = slot;
+    }
+    
+    StreamingGIF::~StreamingGIF()
+    {
+        if (_impl)
+        {
+            for (uint32 i = 0; i < _impl->numIterators; ++i)
             {
-                GT_CHECK(false, "Got bad block format byte. Code expects each block to start with either 0x21, 0x2C or 0x3B");
+                if (_impl->iterators[i].frame) destroyPlayer(_impl->iterators[i]);
             }
+            GT_FREE(_impl->iterators);
+            GT_FREE(_impl->slots);
+            GT_FREE(_impl->tickJobs);
+            GT_FREE(_impl->tickReleases);
             
-            nextBlock = *ptr++;
+            _impl->asset->release();
+            GT_FREE(_impl);
         }
+    }
+}
+
+#pragma mark - IncrementalGIF class methods
+namespace gif_read
+{
+    //what the next bytes fed to an IncrementalGIF are expected to be
+    enum IncrementalState
+    {
+        IS_Header,
+        IS_Blocks, //extensions, image descriptors or the trailer
+        IS_FrameData, //sub blocks of the frame that was started most recently
+        IS_ExtensionData, //sub blocks of an extension that's being skipped
+        IS_Done,
+        IS_Error
+    };
+    
+    //the longest unit that has to arrive whole before it can be parsed: a header with a full global color table.
+    //Frame data and extensions are parsed a sub block at a time, so only their fixed size blocks are ever units
+    const uint32 MAX_INCREMENTAL_UNIT = sizeof(Header) + 256 * sizeof(Color);
+    static_assert(MAX_INCREMENTAL_UNIT >= 1 + sizeof(ImageDescriptor) + 256 * sizeof(Color) + 1, "an image descriptor and local color table must fit in MAX_INCREMENTAL_UNIT");
+    static_assert(MAX_INCREMENTAL_UNIT >= 3 + 255, "an extension's first block must fit in MAX_INCREMENTAL_UNIT");
+    
+    struct IncrementalGIFImpl
+    {
+        //imageData isn't used, only the frame being decoded is kept, and gfxControlBlocks points at gfxBlock,
+        //the last graphics control block seen (the same way decodeFirstFrame does it)
+        GifFileData file;
+        GraphicsControlBlock gfxBlock;
+        
+        IncrementalGIF::FrameCallback onFrame;
+        void* userData;
+        DecodeOptions options;
+        
+        IncrementalState state;
+        ParseResult result;
+        
+        //the start of a header, block or sub block that a chunk ended partway through. Everything else is
+        //parsed straight out of the chunks it arrives in
+        uint8 pending[MAX_INCREMENTAL_UNIT];
+        uint32 pendingSize;
+        
+        uint8* canvas;
+        Frame frame;
+        FrameTarget target;
+        LZWTables tables;
+        DecompressionState dcState; //carried from one sub block to the next, even across calls to feed
+        IndexStream indexStream;
+    };
+    
+    void beginIncrementalFrame(IncrementalGIFImpl& impl, const uint8* dataPtr)
+    {
+        GifFileData& gif = impl.file;
+        Frame& frame = impl.frame;
+        frame = {0};
         
+        dataPtr = parseFrameHeader(dataPtr, frame, gif.pixelFormat);
+        frame.lzwMinCodeSize = *dataPtr;
         
-        Frame& firstFrame = _impl->file.imageData[0];
-        LZWCodeTable codeTable = {0};
-        InitializeCodeTable(codeTable, firstFrame.imageDesc.localColorTableFlag ? firstFrame.imageDesc.colorTableSize : gif.header.screenDescriptor.colorTableSize, firstFrame.lzwMinCodeSize);
-        
-        _impl->decompressionState = {0};
-        
-        _impl->indexStreams = (IndexStream*)GT_MALLOC(sizeof(IndexStream));
-        _impl->indexStreams[0].numIndices = 0;
-        _impl->indexStreams[0].indices = (uint16*)GT_MALLOC(sizeof(uint16) * gif.header.width * gif.header.height);
+        if (frameClearsCanvas(gif))
+        {
+            filBufferWithBackgroundColor(impl.canvas, gif);
+        }
         
-        compressedDataToIndexStream(_impl->compressedData[0], _impl->compressedDataSizes[0],firstFrame.imageDesc.localColorTableFlag ? firstFrame.imageDesc.colorTableSize : gif.header.screenDescriptor.colorTableSize, firstFrame.lzwMinCodeSize, codeTable, _impl->decompressionState, _impl->indexStreams[0]);
+        reserveIndexStream(impl.indexStream, indexStreamSizeForFrame(frame, gif.decoder));
+        impl.indexStream.numIndices = 0;
         
-        uint32 transparentIdx = gif.numGfxBlocks > 0 ? gif.gfxControlBlocks[0].transparentColorIdx : NO_CODE;
-        indexStreamToColorArray(_impl->indexStreams[0], firstFrame.imageDesc.localColorTableFlag ? firstFrame.localColorTable : gif.globalColorTable, _impl->firstFrame, transparentIdx, firstFrame, gif.header);
+        setupFrameTarget(impl.target, impl.canvas, gif, frame, 0); //gfxBlock is the only graphics control block
+        impl.tables.decoder = gif.decoder;
+        InitializeTables(impl.tables, frame.imageDesc.localColorTableFlag ? frame.imageDesc.colorTableSize : gif.header.screenDescriptor.colorTableSize, frame.lzwMinCodeSize);
+        impl.dcState = DecompressionState();
     }
     
-    bool StreamingGIF::tickSingleIterator(uint32 iterator, float deltaTime)
+    void finishIncrementalFrame(IncrementalGIFImpl& impl)
     {
-        if (!isIteratorValid(iterator)) return false;
-        GT_CHECK(iterator < _impl->maxIterators, "Attempting to tick an iterator that does not exist");
-        GT_CHECK(iterator < _impl->numIterators, "Attempting to tick an iterator that does not exist");
-        StreamingGIFIter& iter = _impl->iterators[iterator];
-        iter.currentTime += deltaTime;
+        compositePartialRow(impl.indexStream, impl.target);
         
-        GifFileData& gif = _impl->file;
-        uint32 runTime = gif.totalRunTime;
-        if (runTime == 0) return false;
+        if (impl.frame.localPalette)
+        {
+            GT_FREE(impl.frame.localPalette);
+            impl.frame.localPalette = nullptr;
+        }
         
-        uint32 runningTime = 0;
-        uint32 hundredths = (uint32)(iter.currentTime * 100.0f) % gif.totalRunTime;
+        //a graphics control block only applies to the frame after it, later frames without one get the defaults
+        impl.file.numGfxBlocks = 0;
+        impl.gfxBlock = GraphicsControlBlock();
+        
+        uint32 frameIdx = impl.file.numFrames++;
+        if (impl.onFrame) impl.onFrame(impl.userData, frameIdx, impl.canvas);
+    }
+    
+    //parses every whole unit between dataPtr and dataEnd, leaving dataPtr after the last one. Units are
+    //checked with the same validation functions the bounded constructors use, so a PR_Truncated from one just
+    //means it hasn't finished arriving yet
+    ParseResult parseIncremental(IncrementalGIFImpl& impl, const uint8*& dataPtr, const uint8* dataEnd)
+    {
+        GifFileData& gif = impl.file;
         
-        for (uint32 i = 0; i < gif.numGfxBlocks; ++i)
+        for(;;)
         {
-            runningTime += gif.gfxControlBlocks[i].delayTime;
-            if (hundredths < runningTime)
+            const uint8* unitEnd = dataPtr;
+            ParseResult result = PR_Ok;
+            
+            switch(impl.state)
             {
-                if (iter.currentFrameIdx != i)
+                case IS_Header:
                 {
-                    if (i == 0)
+                    result = validateHeader(unitEnd, dataEnd);
+                    if (result != PR_Ok) return result;
+                    
+                    const uint8* ptr = parseHeader(dataPtr, gif.header);
+                    setupCanvas(gif, impl.options);
+                    parseGlobalColorTable(ptr, &gif.globalPalette, gif.header, gif.pixelFormat);
+                    impl.canvas = (uint8*)GT_MALLOC(gif.canvasWidth * gif.canvasHeight * gif.bytesPerPixel * sizeof(uint8));
+                    filBufferWithBackgroundColor(impl.canvas, gif);
+                    impl.state = IS_Blocks;
+                    
+                }break;
+                case IS_Blocks:
+                {
+                    if (unitEnd >= dataEnd) return PR_Truncated;
+                    uint8 nextBlock = *unitEnd++;
+                    
+                    if (nextBlock == BT_Trailer)
                     {
-                        memcpy(iter.currentFrame, _impl->firstFrame, gif.header.width * gif.header.height * 4 * sizeof(uint8));
+                        impl.state = IS_Done;
+                        dataPtr = unitEnd;
+                        return PR_Ok;
                     }
-                    else
+                    else if (nextBlock == BT_Extension)
                     {
-                        //next frame
-                        Frame& frameData = gif.imageData[i];
-                        uint32 transparentIdx = gif.numGfxBlocks > 0 ? gif.gfxControlBlocks[i].transparentColorIdx : NO_CODE;
-                        Color* colorTable = frameData.localColorTable ? frameData.localColorTable : gif.globalColorTable;
-                        
-                        LZWCodeTable codeTable = {0};
-                        InitializeCodeTable(codeTable, frameData.imageDesc.localColorTableFlag ? frameData.imageDesc.colorTableSize : gif.header.screenDescriptor.colorTableSize, frameData.lzwMinCodeSize);
+                        if (dataEnd - unitEnd < 2) return PR_Truncated;
+                        uint8 extensionType = unitEnd[0];
+                        uint8 blockSizeBytes = unitEnd[1];
                         
-                        _impl->indexStreams[0].numIndices = 0;
-                        
-                        compressedDataToIndexStream(_impl->compressedData[i], _impl->compressedDataSizes[i],frameData.imageDesc.localColorTableFlag ? frameData.imageDesc.colorTableSize : gif.header.screenDescriptor.colorTableSize, frameData.lzwMinCodeSize, codeTable, _impl->decompressionState, _impl->indexStreams[0]);
+                        if (extensionType == ET_GraphicsControl)
+                        {
+                            result = validateExtension(unitEnd, dataEnd);
+                            if (result != PR_Ok) return result;
+                            
+                            gif.numGfxBlocks = 0;
+                            parseExtension(dataPtr + 1, gif.totalRunTime, &impl.gfxBlock, gif.numGfxBlocks);
+                        }
+                        else
+                        {
+                            //everything else is skipped, a sub block at a time like frame data. Comments start
+                            //their first sub block with what would be the block size byte
+                            if (extensionType == ET_Comment)
+                            {
+                                unitEnd += 1;
+                            }
+                            else
+                            {
+                                if (dataEnd - (unitEnd + 2) < blockSizeBytes) return PR_Truncated;
+                                unitEnd += 2 + blockSizeBytes;
+                            }
+                            impl.state = IS_ExtensionData;
+                        }
+                    }
+                    else if (nextBlock == BT_ImageDescriptor)
+                    {
+                        result = validateFrameHeader(unitEnd, dataEnd);
+                        if (result != PR_Ok) return result;
                         
-                        indexStreamToColorArray(_impl->indexStreams[0], colorTable, iter.currentFrame, transparentIdx, frameData, gif.header);
+                        beginIncrementalFrame(impl, dataPtr + 1);
+                        impl.state = IS_FrameData;
+                    }
+                    else
+                    {
+                        return PR_Corrupt;
+                    }
+                    
+                }break;
+                case IS_FrameData:
+                {
+                    if (unitEnd >= dataEnd) return PR_Truncated;
+                    uint8 sizeOfSubBlock = *unitEnd++;
+                    
+                    if (sizeOfSubBlock == 0)
+                    {
+                        finishIncrementalFrame(impl);
+                        impl.state = IS_Blocks;
+                    }
+                    else
+                    {
+                        if (dataEnd - unitEnd < sizeOfSubBlock) return PR_Truncated;
+                        impl.dcState = decompressToFrame(unitEnd, sizeOfSubBlock, impl.frame.lzwMinCodeSize, impl.tables, impl.dcState, impl.indexStream, &impl.target);
+                        unitEnd += sizeOfSubBlock;
+                    }
+                    
+                }break;
+                case IS_ExtensionData:
+                {
+                    if (unitEnd >= dataEnd) return PR_Truncated;
+                    uint8 sizeOfSubBlock = *unitEnd++;
+                    
+                    if (sizeOfSubBlock == 0)
+                    {
+                        impl.state = IS_Blocks;
+                    }
+                    else
+                    {
+                        if (dataEnd - unitEnd < sizeOfSubBlock) return PR_Truncated;
+                        unitEnd += sizeOfSubBlock;
                     }
                     
-                    iter.currentFrameIdx = i;
+                }break;
+                case IS_Done:
+                case IS_Error:
+                {
+                    return impl.result;
                 }
-                return true;
             }
+            
+            dataPtr = unitEnd;
         }
-        
-        return false;
     }
     
-    //will only ever increment the current frame by 1. If you provide a
-    //timestep that requires jumping multiple frames, it will take several
-    //calls to tick() to catch up. This is intentional, to prevent CPU hitches
-    //from causing atypical CPU usage when encountering a hitch in a
-    //running game
-    void StreamingGIF::tick(float deltaTime)
+    IncrementalGIF::IncrementalGIF( FrameCallback onFrame, void* userData, const DecodeOptions& options /* = DecodeOptions() */ )
     {
-        GT_CHECK(deltaTime > 0, "Passed negative time to StreamingGif::Tick()");
-        deltaTime = deltaTime > 0 ? deltaTime : 0;
+        _impl = (IncrementalGIFImpl*)GT_CALLOC(1,sizeof(IncrementalGIFImpl));
+        _impl->file.decoder = options.decoder;
+        _impl->file.gfxControlBlocks = &_impl->gfxBlock;
+        _impl->options = options;
+        _impl->onFrame = onFrame;
+        _impl->userData = userData;
+        _impl->state = IS_Header;
+        _impl->result = PR_Truncated;
+    }
+    
+    ParseResult IncrementalGIF::feed(const uint8* chunk, uint32 chunkSize)
+    {
+        IncrementalGIFImpl& impl = *_impl;
+        if (impl.state == IS_Done || impl.state == IS_Error) return impl.result;
         
-        GifFileData& gif = _impl->file;
-        uint32 runTime = gif.totalRunTime;
-        if (runTime == 0) return;
+        const uint8* chunkEnd = chunk + chunkSize;
+        ParseResult result = PR_Truncated;
         
-        for (uint32 i = 0; i < _impl->numIterators; ++i)
+        //finish off the unit the last chunk ended partway through, copying only as much of this chunk as it takes
+        while (impl.pendingSize > 0 && chunk < chunkEnd)
+        {
+            uint32 oldSize = impl.pendingSize;
+            uint32 copySize = (uint32)(chunkEnd - chunk) < MAX_INCREMENTAL_UNIT - oldSize ? (uint32)(chunkEnd - chunk) : MAX_INCREMENTAL_UNIT - oldSize;
+            memcpy(impl.pending + oldSize, chunk, copySize);
+            impl.pendingSize += copySize;
+            
+            const uint8* dataPtr = impl.pending;
+            result = parseIncremental(impl, dataPtr, impl.pending + impl.pendingSize);
+            uint32 consumed = (uint32)(dataPtr - impl.pending);
+            
+            if (consumed >= oldSize)
+            {
+                //the unit is done, and the rest of what was copied is still in the chunk
+                chunk += consumed - oldSize;
+                impl.pendingSize = 0;
+            }
+            else
+            {
+                //every unit fits in pending, so it can only still be incomplete if the chunk ran out
+                GT_CHECK(chunk + copySize == chunkEnd, "A unit of an incrementally parsed gif didn't fit in its pending buffer");
+                if (chunk + copySize != chunkEnd) result = PR_Corrupt;
+                chunk += copySize;
+            }
+            if (result != PR_Truncated) break;
+        }
+        
+        if (result == PR_Truncated && chunk < chunkEnd)
+        {
+            const uint8* dataPtr = chunk;
+            result = parseIncremental(impl, dataPtr, chunkEnd);
+            
+            //whatever's left is the start of a unit that hasn't finished arriving
+            if (result == PR_Truncated)
+            {
+                uint32 leftover = (uint32)(chunkEnd - dataPtr);
+                GT_CHECK(leftover <= MAX_INCREMENTAL_UNIT, "A unit of an incrementally parsed gif didn't fit in its pending buffer");
+                if (leftover > MAX_INCREMENTAL_UNIT)
+                {
+                    result = PR_Corrupt;
+                }
+                else
+                {
+                    memcpy(impl.pending, dataPtr, leftover);
+                    impl.pendingSize = leftover;
+                }
+            }
+        }
+        
+        if (impl.state == IS_Done)
+        {
+            result = PR_Ok;
+        }
+        else if (result == PR_Ok)
+        {
+            result = PR_Truncated;
+        }
+        else if (result != PR_Truncated)
         {
-            tickSingleIterator(i, deltaTime);
+            impl.state = IS_Error;
         }
+        
+        impl.result = result;
+        return result;
     }
     
-    bool StreamingGIF::isIteratorValid(uint32 iterator)
+    uint32 IncrementalGIF::getWidth() const
     {
-        if (iterator > _impl->maxIterators) return false;
-        if (iterator > _impl->numIterators) return false;
-        if (_impl->iterators[iterator].currentFrame == nullptr) return false;
-        return true;
+        return _impl->file.canvasWidth;
     }
     
-    uint32 StreamingGIF::createIterator()
+    uint32 IncrementalGIF::getHeight() const
     {
-        StreamingGIFIter& iter = _impl->iterators[_impl->numIterators];
-        iter.currentFrame = 0;
-        iter.currentTime = 0;
-        iter.currentFrameIdx = 0;
-        GifFileData& gif = _impl->file;
-        
-        iter.currentFrame = (uint8*)GT_MALLOC(gif.header.width * gif.header.height * 4 * sizeof(uint8));
-        memcpy(iter.currentFrame, _impl->firstFrame, gif.header.width * gif.header.height * 4 * sizeof(uint8));
-        
-        _impl->numIterators++;
-        return _impl->numIterators-1;
+        return _impl->file.canvasHeight;
     }
     
-    void StreamingGIF::destroyIterator(uint32 iterator)
+    uint32 IncrementalGIF::getNumFrames() const
     {
-        if (_impl->iterators[iterator].currentFrame)
-        {
-            GT_FREE(_impl->iterators[iterator].currentFrame);
-        }
-        else
-        {
-            GT_CHECK(iterator < _impl->maxIterators, "Attempting to free an iterator with index > maxIterators");
-            GT_CHECK(0, "Attemping to destroy an iterator that has not been created");
-        }
+        return _impl->file.numFrames;
     }
     
-    StreamingGIF::~StreamingGIF()
+    const uint8* IncrementalGIF::getCurrentFrame() const
     {
-        GT_FREE(_impl->indexStreams[0].indices);
-        GT_FREE(_impl->indexStreams);
-        
-        for (uint16 i = 0; i < _impl->file.numFrames; ++i)
-        {
-            GT_FREE(_impl->compressedData[i]);
-        }
-        GT_FREE(_impl->compressedData);
-        GT_FREE(_impl->compressedDataSizes);
-        
-        if (_impl)
-        {
-            GT_FREE(_impl->file.globalColorTable);
-            
-            if (_impl->firstFrame)
-            {
-                GT_FREE(_impl->firstFrame);
-                _impl->firstFrame = nullptr;
-            }
-            
-            for (uint32 i = 0; i < _impl->maxIterators; ++i)
-            {
-                destroyIterator(i);
-            }
-            
-            GT_FREE(_impl);
-        }
+        return _impl->canvas;
+    }
+    
+    IncrementalGIF::~IncrementalGIF()
+    {
+        GT_FREE(_impl->canvas);
+        GT_FREE(_impl->indexStream.indices);
+        if (_impl->frame.localPalette) GT_FREE(_impl->frame.localPalette);
+        GT_FREE(_impl->file.globalPalette);
+        GT_FREE(_impl);
     }
 }
 
@@ -946,3 +3397,5 @@ namespace gif_read
 #undef GT_CALLOC
 #undef GT_FREE
 #undef GT_CHECK
+#undef GT_SIMD_X86
+#undef GT_SIMD_NEON
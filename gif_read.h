@@ -18,15 +18,124 @@ namespace gif_read
 {
     typedef uint16_t uint16;
     typedef uint32_t uint32;
+    typedef uint64_t uint64;
     typedef uint8_t  uint8;
     typedef int32_t int32;
     
     //make sure any replacement types are still the right size
     static_assert(sizeof(uint16) == 2, "uint16 type is an incorrect size");
     static_assert(sizeof(uint32) == 4, "uint32 type is an incorrect size");
+    static_assert(sizeof(uint64) == 8, "uint64 type is an incorrect size");
     static_assert(sizeof(uint8) == 1, "uint8 type is an incorrect size");
     static_assert(sizeof(int32) == 4, "int32 type is an incorrect size");
     
+    //which LZW decoder to decompress frames with. Both produce identical output
+    enum LZWDecoder
+    {
+        LD_CodeTable, //walks a linked list of code table rows for each code
+        LD_CopyFromOutput //copies each code's string from where it was last written in the frame
+    };
+    
+    //layout of every pixel that gets decoded. Formats are converted when color tables are parsed, so picking one
+    //costs nothing per pixel
+    enum PixelFormat
+    {
+        PF_RGBA8888, //4 bytes per pixel, in that order in memory
+        PF_BGRA8888,
+        PF_RGB888, //3 bytes per pixel
+        PF_RGB565, //2 bytes per pixel, a native endian uint16 with red in the top 5 bits
+        PF_RGBA8888Premultiplied, //RGBA with the color channels already multiplied by alpha
+        PF_A8 //1 byte per pixel, only alpha. For using a gif as a mask
+    };
+    
+    //result of constructing a GIF or StreamingGIF from a buffer with a known size
+    enum ParseResult
+    {
+        PR_Ok,
+        PR_Truncated, //the buffer ends before the gif does
+        PR_Corrupt, //the buffer isn't a gif, or contains blocks that can't be parsed
+        PR_Unsupported //the gif is interlaced, has sorted color tables or uses restore to previous disposal
+    };
+    
+    //options for how a gif gets decoded. Default constructed options give the same results as not passing any
+    struct DecodeOptions
+    {
+        LZWDecoder decoder = LD_CodeTable;
+        
+        //GIF only. Number of threads to decompress frames on, with frames still composited in order on the
+        //calling thread. 0 uses one thread per core, 1 decodes everything on the calling thread
+        uint32 numThreads = 1;
+        
+        //StreamingGIF only. Keeps a pointer to gifFileData and decompresses frames straight out of it, instead of
+        //copying every frame's compressed data. gifFileData has to stay alive and unchanged for as long as the
+        //StreamingGIF does, so this suits memory mapped files, or one asset blob shared by many StreamingGIFs
+        bool referenceFileData = false;
+        
+        //GIF only. Stores each frame as one palette index per pixel instead of RGBA, along with the id of the palette
+        //they index into, for a quarter of the memory. getFrame() and getFrameAtTime() return nullptr for those
+        //frames, use getFrameIndices() and getPalette(), or getFrameRGBA() instead. Frames with too many colors
+        //for indices are still stored in color (see GIF::getFrameIndices), so this is never lossy
+        bool storeIndices = false;
+        
+        //1, 2, 4 or 8. Frames are decoded at 1/downscale of the gif's width and height, by only compositing every
+        //downscale'th pixel of every downscale'th row, so full size frames are never stored. Other values are
+        //rounded down to one of those. getWidth() and getHeight() return the downscaled size
+        uint32 downscale = 1;
+        
+        //layout of every frame that comes out of the decoder, including getFrameRGBA()
+        PixelFormat pixelFormat = PF_RGBA8888;
+        
+        //the canvas starts out, and is cleared by DM_CLEAR_TO_BACKGROUND, as transparent black instead of the
+        //gif's background color. Transparent pixels show whatever is under them as usual, so they come out with
+        //alpha 0 wherever no frame has drawn since the last clear. Formats without alpha get black there
+        bool transparentBackground = false;
+        
+        //only decode the part of each frame inside this rectangle, in the gif's pixels. Nothing outside it is
+        //looked up in a palette or written, and frames are only the size of the rectangle (after it's clipped
+        //to the gif). A cropWidth or cropHeight of 0 decodes the whole frame. Applied before downscale
+        uint32 cropX = 0;
+        uint32 cropY = 0;
+        uint32 cropWidth = 0;
+        uint32 cropHeight = 0;
+    };
+    
+    //metadata read by probe(), without decoding any frames
+    struct GifInfo
+    {
+        uint32 width = 0;
+        uint32 height = 0;
+        uint32 numFrames = 0;
+        uint32 totalRunTime = 0; //sum of every frame's delay, in hundredths of a second
+        int32 loopCount = -1; //from the NETSCAPE2.0 extension. 0 loops forever, -1 means the gif doesn't have one
+    };
+    
+    struct FrameInfo
+    {
+        uint16 xPos; //(0,0) is top left of the canvas
+        uint16 yPos;
+        uint16 width;
+        uint16 height;
+        uint16 delayTime; //hundredths of a second, 0 if the frame has no graphics control block
+        bool hasTransparency;
+        bool hasLocalColorTable;
+    };
+    
+    //reads a gif's metadata without decoding anything or allocating any memory. Frames are skipped over using
+    //only their sub block sizes. If outFrames isn't null, the first maxFrames frames are described in it, but
+    //outInfo.numFrames counts all of them. Never reads past gifFileData + fileSize, and outInfo is only
+    //complete if the result is PR_Ok
+    ParseResult probe( const uint8* gifFileData, uint32 fileSize, GifInfo& outInfo, FrameInfo* outFrames = nullptr, uint32 maxFrames = 0 );
+    
+    //decodes just the first frame, for thumbnails and previews. Parsing stops at the end of the first frame, so the
+    //rest of the file is never read, and the only memory allocated is outRGBA (outWidth * outHeight RGBA pixels,
+    //starting from the background color). Free outRGBA with freeFrame(). If the result isn't PR_Ok, outRGBA is
+    //null. Never reads past gifFileData + fileSize
+    ParseResult decodeFirstFrame( const uint8* gifFileData, uint32 fileSize, uint8*& outRGBA, uint32& outWidth, uint32& outHeight, const DecodeOptions& options = DecodeOptions() );
+    
+    //frees a frame returned by decodeFirstFrame(). That's plain free() unless gif_read.cpp's allocator macros have
+    //been changed, but this always matches them
+    void freeFrame(uint8* frame);
+    
     //memory heavy GIF class that provides access to any frame of a GIF in arbitrary order
     //keeps a uint8 rgb array of every frame in memory all the time, giving the fastest access to
     //data at runtime, at a large memory cost.
@@ -36,7 +145,12 @@ namespace gif_read
         //gifFileData is the binary contents of a .gif file. Ctor will memcpy
         //out of this data, but doesn't need it after the ctor finishes.
         //dealloc the gifFileData ptr yourself after constructing a GIF
-        GIF( const uint8* gifFileData );
+        GIF( const uint8* gifFileData, const DecodeOptions& options = DecodeOptions() );
+        
+        //never reads past gifFileData + fileSize. If outResult is anything but PR_Ok, the file
+        //wasn't parsed at all, and the GIF is left with no frames (getNumFrames() is 0, and the frame
+        //getters return nullptr)
+        GIF( const uint8* gifFileData, uint32 fileSize, ParseResult& outResult, const DecodeOptions& options = DecodeOptions() );
         ~GIF();
         
         uint32 getWidth() const;
@@ -44,25 +158,122 @@ namespace gif_read
         uint32 getNumFrames() const;
         
         //returns an array of unsigned byte RGBA pixel data for a texture with the dimensions
-        //defined by the getWidth() and getHeight() function calls. Alpha will always be 255
+        //defined by the getWidth() and getHeight() function calls. Alpha will always be 255 unless
+        //DecodeOptions::transparentBackground was set, and pixels are in a different format if
+        //DecodeOptions::pixelFormat was. Returns nullptr for a frame index past getNumFrames(), and for frames
+        //stored as indices (see getFrameIndices)
         const uint8* getFrame(uint32 frameIndex) const;
         const uint8* getFrameAtTime(float time, bool looping = true) const;
         
+        //only for GIFs loaded with storeIndices. A frame is getWidth() * getHeight() indices into the 256 four byte
+        //entries of its palette, each holding one pixel in the GIF's pixelFormat (RGBA by default). Consecutive
+        //frames share a palette id unless a frame brings in new colors. Indices are always exact, so frames
+        //with more than 256 colors visible at once (and the frames after them, until the canvas is cleared or
+        //back down to 256 colors) are stored the same way getFrame() returns them instead. getFrameIndices()
+        //returns nullptr and getFramePaletteId() returns 0xFFFFFFFF for those
+        const uint8* getFrameIndices(uint32 frameIndex) const;
+        uint32 getFramePaletteId(uint32 frameIndex) const;
+        uint32 getNumPalettes() const; //0 without storeIndices
+        const uint8* getPalette(uint32 paletteId) const; //nullptr without storeIndices, or if paletteId >= getNumPalettes()
+        
+        //writes getWidth() * getHeight() pixels of the frame to outRGBA, however the frames are stored. Pixels are
+        //in the GIF's pixelFormat, which is RGBA unless DecodeOptions said otherwise. Writes nothing for a frame
+        //index past getNumFrames()
+        void getFrameRGBA(uint32 frameIndex, uint8* outRGBA) const;
+        
     private:
         struct GIFImpl* _impl = nullptr;
     };
     
+    //lets StreamingGIF::tick() hand frame decodes to your own job system or thread pool
+    class TaskScheduler
+    {
+    public:
+        typedef void (*Job)(void* jobData, uint32 jobIndex);
+        virtual ~TaskScheduler() {}
+        
+        //call job(jobData, i) for every i in [0, numJobs), on whatever threads you like, and only return once
+        //every call has returned. Jobs are independent of each other and can run in any order
+        virtual void run(Job job, void* jobData, uint32 numJobs) = 0;
+    };
+    
+    //the immutable part of a StreamingGIF: the parsed gif, its compressed frame data and its first frame. Any number
+    //of GifPlayers can play one asset, from any threads. Assets are reference counted, create() returns one with
+    //a single reference owned by the caller, every GifPlayer holds one of its own, and the asset is destroyed once
+    //the last one is released. retain() and release() are thread safe
+    class GifAsset
+    {
+    public:
+        //same as the StreamingGIF ctors. If outResult is anything but PR_Ok, the asset has no frames, getFirstFrame()
+        //returns nullptr and so does getCurrentFrame() on any player of it
+        static GifAsset* create( const uint8* gifFileData, const DecodeOptions& options = DecodeOptions() );
+        static GifAsset* create( const uint8* gifFileData, uint32 fileSize, ParseResult& outResult, const DecodeOptions& options = DecodeOptions() );
+        
+        void retain();
+        void release();
+        
+        uint32 getWidth() const;
+        uint32 getHeight() const;
+        uint32 getNumFrames() const;
+        float getDurationInSeconds() const;
+        const uint8* getFirstFrame() const;
+        
+    private:
+        GifAsset() = default;
+        ~GifAsset();
+        GifAsset(const GifAsset&) = delete;
+        GifAsset& operator=(const GifAsset&) = delete;
+        
+        friend class GifPlayer;
+        friend class StreamingGIF;
+        struct GifAssetImpl* _impl = nullptr;
+    };
+    
+    //plays a GifAsset. Players are small: they share decoded frames with every other player of the asset showing
+    //the same pixels, and only need a frame of their own once they get out of step. Create and destroy them on
+    //any thread, as many as you like, and tick different players on different threads at the same time. A single
+    //player should only be used from one thread at a time
+    class GifPlayer
+    {
+    public:
+        GifPlayer( GifAsset* asset ); //takes a reference to asset, so the caller can release theirs
+        ~GifPlayer();
+        GifPlayer(const GifPlayer&) = delete;
+        GifPlayer& operator=(const GifPlayer&) = delete;
+        
+        //returns true if time has advanced enough to get a new frame
+        bool tick(float deltaTime);
+        
+        //getAsset()->getWidth() * getAsset()->getHeight() pixels, valid until the next tick(). nullptr if the asset
+        //failed to load
+        const uint8* getCurrentFrame() const;
+        uint32 getCurrentFrameIndex() const;
+        GifAsset* getAsset() const;
+        
+    private:
+        struct PlayerState* _impl = nullptr;
+    };
+    
     //Instead of storing index streams, only the compressed gif data is stored, and is decompressed as new frames are needed
     //To support multiple instances of a GIF displaying different frames, StreamingGIFs are accessed through gif-erators
-    //(my stupid name for gif iterators), which require an allocation of 1 frame of gif data each. The memory for all
-    //giferators is handled by the streamingGIF class they're allocated by, and accessed through a uint32 handle.
+    //(my stupid name for gif iterators). Iterators showing the same pixels share one reference counted frame, so
+    //iterators in lockstep only decode each frame once, and only cost a frame of memory each once they diverge.
+    //The memory for all giferators is handled by the streamingGIF class they're allocated by, and accessed
+    //through a uint32 handle. A StreamingGIF is a GifAsset plus a set of players, use those directly
+    //if you need players that can come and go on different threads
     class StreamingGIF
     {
     public:
         //gifFileData is the binary contents of a .gif file. Ctor will memcpy
-        //out of this data, but doesn't need it after the ctor finishes.
-        //dealloc the gifFileData ptr yourself after construction
-        StreamingGIF( const uint8* gifFileData, uint32 maxIterators = 8 );
+        //out of this data, but doesn't need it after the ctor finishes (unless
+        //options.referenceFileData is set). dealloc the gifFileData ptr yourself after construction.
+        //maxIterators is only how many iterators there's room for up front, more get room made as they're created
+        StreamingGIF( const uint8* gifFileData, uint32 maxIterators = 8, const DecodeOptions& options = DecodeOptions() );
+        
+        //never reads past gifFileData + fileSize. If outResult is anything but PR_Ok, the file
+        //wasn't parsed at all, and the StreamingGIF is left with no frames (getFirstFrame() and getCurrentFrame()
+        //return nullptr for every iterator)
+        StreamingGIF( const uint8* gifFileData, uint32 fileSize, ParseResult& outResult, uint32 maxIterators = 8, const DecodeOptions& options = DecodeOptions() );
         ~StreamingGIF();
         StreamingGIF(const StreamingGIF&) = delete;
         StreamingGIF& operator=(const StreamingGIF&) = delete;
@@ -72,19 +283,64 @@ namespace gif_read
         uint32 getNumFrames() const;
         float getDurationInSeconds() const;
         
+        //creating and destroying iterators is O(1), and destroyed iterators' memory is reused. Handles to a
+        //destroyed iterator stay invalid even once its memory is reused. Up to 65535 iterators can be alive at
+        //once, past that createIterator() returns a handle that's never valid
         uint32 createIterator();
         bool isIteratorValid(uint32 iterator);
         void destroyIterator(uint32 iterator);
         
-        //returns true if time has advanced enough to get a new frame
+        //returns true if time has advanced enough to get a new frame. Every iterator decodes with its own scratch
+        //space, so different iterators can be ticked from different threads at the same time (creating or
+        //destroying iterators still can't overlap with ticking)
         bool tickSingleIterator(uint32 interator, float deltaTime);
         void tick(float deltaTime); //ticks all iterators
         
+        //ticks all iterators, decoding the frames of iterators that need a new one as parallel jobs on scheduler.
+        //Returns once all of them are composited. Ends up in the same place as tick(deltaTime)
+        void tick(float deltaTime, TaskScheduler& scheduler);
+        
         const uint8* getFirstFrame() const;
         const uint8* getCurrentFrame(uint32 interator) const;
         
+        //the asset the iterators play, for creating GifPlayers that share its frames. Retain it to keep it
+        //past the StreamingGIF's lifetime
+        GifAsset* getAsset() const;
+        
     protected:
         struct StreamingGIFImpl* _impl = nullptr;
         
     };
+    
+    //parses a gif as its data arrives in chunks, instead of needing the whole file up front. Each frame is decoded
+    //as its sub blocks arrive, and handed to a callback as soon as the last one does. Chunks are parsed where they
+    //are, and only the canvas the frames are composited onto (plus the under 1KB start of a block a chunk ended
+    //partway through) is kept in memory, so memory use doesn't grow with the length of the stream
+    class IncrementalGIF
+    {
+    public:
+        //called from feed() each time a frame finishes. rgba is getWidth() * getHeight() RGBA pixels, and is only
+        //valid until the callback returns
+        typedef void (*FrameCallback)(void* userData, uint32 frameIndex, const uint8* rgba);
+        
+        IncrementalGIF( FrameCallback onFrame, void* userData, const DecodeOptions& options = DecodeOptions() );
+        ~IncrementalGIF();
+        IncrementalGIF(const IncrementalGIF&) = delete;
+        IncrementalGIF& operator=(const IncrementalGIF&) = delete;
+        
+        //parses as far as the data fed so far allows. Chunks can be any size, and don't need to line up with
+        //anything in the file. Returns PR_Truncated until the end of the gif has been fed, then PR_Ok. Any
+        //other result means the data can't be parsed, and every later call returns the same thing
+        ParseResult feed(const uint8* chunk, uint32 chunkSize);
+        
+        uint32 getWidth() const; //0 until the header has been fed
+        uint32 getHeight() const;
+        uint32 getNumFrames() const; //frames finished so far
+        
+        //the canvas, including any rows of the frame currently being decoded. Null until the header has been fed
+        const uint8* getCurrentFrame() const;
+        
+    private:
+        struct IncrementalGIFImpl* _impl = nullptr;
+    };
 }
@@ -0,0 +1,112 @@
+//
+//  expand_row_test.cpp
+//  gif_read
+//
+//  checks every palette expansion kernel this machine can run against the scalar reference, on random
+//  rows, palettes and transparent indices. Build it next to gif_read.cpp and run it, ie:
+//  clang++ -std=c++14 -O2 tests/expand_row_test.cpp -o expand_row_test && ./expand_row_test
+//  returns 0 if every kernel matched
+//
+
+//the kernels aren't declared in gif_read.h, so the test is compiled together with them
+#include "../gif_read.cpp"
+
+#include <stdio.h>
+#include <random>
+
+using namespace gif_read;
+
+namespace
+{
+    struct Kernel
+    {
+        const char* name;
+        ExpandRowFunc func;
+    };
+
+    //what expandRowScalar promises, written as plainly as possible so the reference gets checked too
+    void expandRowNaive(uint32* out, const uint8* indices, uint32 count, const uint32* palette, uint32 transparentIdx)
+    {
+        for (uint32 i = 0; i < count; ++i)
+        {
+            if (indices[i] != transparentIdx) out[i] = palette[indices[i]];
+        }
+    }
+
+    uint32 numKernels(Kernel* outKernels)
+    {
+        uint32 num = 0;
+        outKernels[num++] = { "scalar", expandRowScalar };
+#if defined(__x86_64__) || defined(__i386__)
+#ifndef GT_NO_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse2")) outKernels[num++] = { "sse2", expandRowSSE2 };
+        if (__builtin_cpu_supports("avx2")) outKernels[num++] = { "avx2", expandRowAVX2 };
+#endif
+#elif defined(__ARM_NEON) && !defined(GT_NO_SIMD)
+        outKernels[num++] = { "neon", expandRowNEON };
+#endif
+        return num;
+    }
+}
+
+int main()
+{
+    const uint32 MAX_ROW = 300;
+    const uint32 NUM_ROWS = 20000;
+
+    Kernel kernels[4];
+    uint32 kernelCount = numKernels(kernels);
+
+    std::mt19937 rng(1234);
+    uint32 palette[256];
+    uint8 indices[MAX_ROW + 16];
+    uint32 prev[MAX_ROW + 16];
+    uint32 expected[MAX_ROW + 16];
+    uint32 actual[MAX_ROW + 16];
+    uint32 failures = 0;
+
+    for (uint32 row = 0; row < NUM_ROWS; ++row)
+    {
+        for (uint32 i = 0; i < 256; ++i) palette[i] = rng();
+
+        //small palettes make transparent runs likely, and offsets make the rows unaligned
+        uint32 numColors = 1 + rng() % 256;
+        uint32 count = rng() % (MAX_ROW + 1);
+        uint32 offset = rng() % 16;
+        for (uint32 i = 0; i < count + offset; ++i)
+        {
+            indices[i] = (uint8)(rng() % numColors);
+            prev[i] = rng();
+        }
+
+        uint32 transparentIdx;
+        switch (rng() % 4)
+        {
+            case 0: transparentIdx = NO_CODE; break;
+            case 1: transparentIdx = 256; break;
+            default: transparentIdx = rng() % numColors; break;
+        }
+
+        memcpy(expected, prev, sizeof(expected));
+        expandRowNaive(expected + offset, indices + offset, count, palette, transparentIdx);
+
+        for (uint32 k = 0; k < kernelCount; ++k)
+        {
+            memcpy(actual, prev, sizeof(actual));
+            kernels[k].func(actual + offset, indices + offset, count, palette, transparentIdx);
+            if (memcmp(actual, expected, sizeof(actual)) != 0)
+            {
+                if (failures < 10)
+                {
+                    printf("%s kernel doesn't match, row %u (%u pixels at offset %u, transparentIdx %u)\n", kernels[k].name, row, count, offset, transparentIdx);
+                }
+                failures++;
+            }
+        }
+    }
+
+    for (uint32 k = 0; k < kernelCount; ++k) printf("tested %s kernel\n", kernels[k].name);
+    printf("%u rows, %u mismatches\n", NUM_ROWS, failures);
+    return failures == 0 ? 0 : 1;
+}
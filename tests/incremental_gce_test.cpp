@@ -0,0 +1,146 @@
+//
+//  incremental_gce_test.cpp
+//  gif_read
+//
+//  feeds IncrementalGIF a gif where only the first frame has a graphics control block, in chunks of a few
+//  different sizes, and checks every frame it calls back with against GIF::getFrame. Build it with gif_read.cpp:
+//  clang++ -std=c++14 -O2 gif_read.cpp tests/incremental_gce_test.cpp -o incremental_gce_test && ./incremental_gce_test
+//  returns 0 if every frame matched
+//
+
+#include "../gif_read.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+using namespace gif_read;
+
+namespace
+{
+    const uint32 WIDTH = 2;
+    const uint32 HEIGHT = 1;
+    const uint32 NUM_FRAMES = 3;
+
+    void push16(std::vector<uint8>& out, uint32 value)
+    {
+        out.push_back((uint8)(value & 0xFF));
+        out.push_back((uint8)(value >> 8));
+    }
+
+    //a frame of one or two pixels, from 2 bit indices. That's few enough codes that the code size never
+    //grows past 3 bits, so the codes can be packed as clear, each index, end of information
+    void pushFrame(std::vector<uint8>& out, uint32 x, const uint8* indices, uint32 count)
+    {
+        out.push_back(0x2C);
+        push16(out, x);
+        push16(out, 0);
+        push16(out, count);
+        push16(out, 1);
+        out.push_back(0); //no local color table
+        out.push_back(2); //lzw min code size
+
+        uint32 bits = 4; //clear code
+        uint32 numBits = 3;
+        for (uint32 i = 0; i < count; ++i, numBits += 3) bits |= indices[i] << numBits;
+        bits |= 5 << numBits; //end of information
+        numBits += 3;
+
+        uint32 numBytes = (numBits + 7) / 8;
+        out.push_back((uint8)numBytes);
+        for (uint32 i = 0; i < numBytes; ++i) out.push_back((uint8)(bits >> (i * 8)));
+        out.push_back(0);
+    }
+
+    //frame 0 treats index 0 as transparent. Frames 1 and 2 have no graphics control block, so index 0 is
+    //opaque red for them
+    std::vector<uint8> makeGif()
+    {
+        std::vector<uint8> out;
+        const char* header = "GIF89a";
+        out.insert(out.end(), header, header + 6);
+        push16(out, WIDTH);
+        push16(out, HEIGHT);
+        out.push_back(0x81); //global color table of 4 entries
+        out.push_back(3); //background is white
+        out.push_back(0);
+
+        const uint8 colors[] = { 255,0,0, 0,255,0, 0,0,255, 255,255,255 };
+        out.insert(out.end(), colors, colors + sizeof(colors));
+
+        const uint8 gce[] = { 0x21, 0xF9, 4, 1, 10, 0, 0, 0 }; //transparent index 0
+        out.insert(out.end(), gce, gce + sizeof(gce));
+        const uint8 green[] = { 1, 1 };
+        pushFrame(out, 0, green, 2);
+
+        const uint8 red[] = { 0 };
+        pushFrame(out, 0, red, 1);
+
+        const uint8 blue[] = { 2 };
+        pushFrame(out, 1, blue, 1);
+
+        out.push_back(0x3B);
+        return out;
+    }
+
+    struct Frames
+    {
+        std::vector<uint8> pixels[NUM_FRAMES];
+        uint32 count;
+    };
+
+    void onFrame(void* userData, uint32 frameIndex, const uint8* rgba)
+    {
+        Frames& frames = *(Frames*)userData;
+        if (frameIndex < NUM_FRAMES) frames.pixels[frameIndex].assign(rgba, rgba + WIDTH * HEIGHT * 4);
+        frames.count++;
+    }
+}
+
+int main()
+{
+    std::vector<uint8> data = makeGif();
+    uint32 failures = 0;
+
+    ParseResult result;
+    GIF reference(data.data(), (uint32)data.size(), result);
+    if (result != PR_Ok || reference.getNumFrames() != NUM_FRAMES)
+    {
+        printf("GIF couldn't parse the test gif\n");
+        return 1;
+    }
+
+    const uint32 chunkSizes[] = { 1, 7, (uint32)data.size() };
+    for (uint32 chunkSize : chunkSizes)
+    {
+        Frames frames;
+        frames.count = 0;
+        IncrementalGIF incremental(onFrame, &frames);
+
+        result = PR_Truncated;
+        for (uint32 offset = 0; offset < data.size() && result == PR_Truncated; offset += chunkSize)
+        {
+            uint32 size = (uint32)data.size() - offset < chunkSize ? (uint32)data.size() - offset : chunkSize;
+            result = incremental.feed(data.data() + offset, size);
+        }
+
+        if (result != PR_Ok || frames.count != NUM_FRAMES)
+        {
+            printf("%u byte chunks: got %u frames, result %d\n", chunkSize, frames.count, (int)result);
+            failures++;
+            continue;
+        }
+
+        for (uint32 i = 0; i < NUM_FRAMES; ++i)
+        {
+            if (memcmp(frames.pixels[i].data(), reference.getFrame(i), WIDTH * HEIGHT * 4) != 0)
+            {
+                printf("%u byte chunks: frame %u doesn't match GIF\n", chunkSize, i);
+                failures++;
+            }
+        }
+    }
+
+    printf("%u mismatches\n", failures);
+    return failures == 0 ? 0 : 1;
+}